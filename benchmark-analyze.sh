@@ -0,0 +1,21 @@
+#!/usr/bin/env bash
+
+# Shows how computing the block summaries of a trace scales with the number of
+# threads, and checks that every thread count produces the same summaries.
+#
+# Usage: benchmark-analyze.sh trace [max threads]
+
+DIR=$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )
+
+TRACE=$1
+MAX_THREADS=${2:-$(nproc)}
+
+THREADS=1
+while [ $THREADS -le $MAX_THREADS ] ; do
+    $DIR/build/fslice-analyze -n -j $THREADS \
+        -s /tmp/benchmark-analyze.$THREADS.txt $TRACE
+    if ! cmp -s /tmp/benchmark-analyze.1.txt /tmp/benchmark-analyze.$THREADS.txt ; then
+        echo "Summaries with $THREADS threads differ from 1 thread!"
+    fi
+    THREADS=$((THREADS * 2))
+done
@@ -2,21 +2,96 @@
 
 #define DEBUG_TYPE "FSlice"
 
+#include <llvm/ADT/Twine.h>
+#include <llvm/Analysis/LoopInfo.h>
 #include <llvm/IR/Constants.h>
+#include <llvm/IR/DebugInfo.h>
 #include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Dominators.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/IntrinsicInst.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
 #include <llvm/Pass.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
 
+#include <algorithm>
+#include <deque>
 #include <iostream>
 #include <map>
+#include <set>
+#include <string>
 #include <vector>
 
 using namespace llvm;
 
+static cl::opt<bool> PruneUntainted(
+    "fslice-prune",
+    cl::desc("Only instrument values and memory that can be reached by "
+             "taint sources."),
+    cl::init(false));
+
+static cl::opt<bool> InlineShadowChecks(
+    "fslice-inline",
+    cl::desc("Check the shadow memory inline, and only call the runtime's "
+             "load and store hooks if memory might be tainted."),
+    cl::init(false));
+
+static cl::opt<bool> ProfileSites(
+    "fslice-profile-sites",
+    cl::desc("Give every hook call a site id, so that the runtime can "
+             "attribute the cost of the hooks to source lines."),
+    cl::init(false));
+
+static cl::opt<bool> CoalesceFields(
+    "fslice-coalesce",
+    cl::desc("Instrument runs of loads or stores of fields of the same object "
+             "with one hook per run."),
+    cl::init(false));
+
+static cl::opt<bool> ReuseTaints(
+    "fslice-reuse",
+    cl::desc("Reuse the taints of earlier loads of the same memory, and hoist "
+             "the loads of loop-invariant memory out of loops."),
+    cl::init(false));
+
+static cl::list<std::string> SummarizeFuncs(
+    "fslice-summarize",
+    cl::desc("Trace calls to these pure functions as single summary nodes, "
+             "instead of instrumenting them. Each is `name[:ptr:size]...`, "
+             "where `ptr` is the number of a pointer argument to input "
+             "memory, and `size` is the number of the argument holding its "
+             "size, or `s` if the memory is a NUL-terminated string. "
+             "Functions can also be annotated with `fslice_summary[:ptr:size]"
+             "...`."),
+    cl::CommaSeparated);
+
+enum : uint64_t {
+  // These must match the runtime's shadow page directory, `__fslice_shadow`.
+  kShadowPageShift = 12,
+  kShadowNumPages = 1ULL << (47 - kShadowPageShift),
+
+  // Number of argument taint slots in the runtime's `__fslice_args`. Taints
+  // of later arguments are dropped.
+  kNumArgTaints = 16,
+
+  // Longest run of field accesses, and the most bytes that a run can span.
+  kMaxFieldRun = 16,
+  kMaxFieldSpan = 256,
+
+  // Size argument of a summary's input memory that is a string.
+  kSummaryString = 0xFFFFFFFFULL,
+
+  // Priority of the constructors that register the module's tables with the
+  // runtime. The runtime's globals are constructed at priority 101, and the
+  // module's own constructors, which can call hooks, run at 65535.
+  kRegisterPriority = 102
+};
+
 // Set of llvm values that represent a logical variables.
 struct VSet {
   VSet *rep;
@@ -29,6 +104,36 @@ struct IInfo {
   Instruction *I;
 };
 
+// Node in a unification-based (Steensgaard-style) points-to graph. Values that
+// may flow into each other share a node, and `pointee` is the node of the
+// values stored in the memory that those values point to. `is_tainted` is
+// true if the values of the node can derive from a taint source.
+struct PNode {
+  PNode *rep;
+  PNode *pointee;
+  bool is_tainted;
+};
+
+// Run of loads, or of stores, in one basic block whose addresses are constant
+// offsets from the same base pointer. `Layout` holds the offset and size of
+// each access.
+struct FieldRun {
+  Value *Base;
+  bool IsStore;
+  int64_t Begin;
+  int64_t End;
+  std::vector<Instruction *> Accesses;
+  std::vector<uint64_t> Layout;
+};
+
+// Summary of a pure function. `Ranges` holds the numbers of each pointer
+// argument to input memory, and of the argument holding the size of that
+// memory, or `kSummaryString`.
+struct Summary {
+  unsigned Index;
+  std::vector<std::pair<unsigned,unsigned>> Ranges;
+};
+
 // Introduces generic dynamic program slic recording into code.
 class FSliceModulePass : public ModulePass {
  public:
@@ -46,21 +151,58 @@ class FSliceModulePass : public ModulePass {
   static VSet *getVSet(VSet *VSet);
   void labelVSets(void);
   void allocaVSetArray(void);
+  void reuseLoadTaints(void);
+  void hoistLoadTaint(LoadInst *LI, BasicBlock *Preheader);
+  void collectFieldRuns(void);
+  void collectClearedAllocas(void);
+
+  void analyzeModule(void);
+  void analyzeInitializer(PNode *N, Constant *C);
+  void analyzeInstruction(Instruction *I);
+  void analyzeCall(CallInst *CI, Function *Callee);
+  PNode *getPNode(Value *V);
+  PNode *getRetPNode(Function *F_);
+  PNode *getPointee(Value *V);
+  PNode *newPNode(void);
+  static PNode *findPNode(PNode *N);
+  void unifyPNodes(PNode *N1, PNode *N2);
+  bool mayBeTainted(Value *V);
+  bool mayPointToTaint(Value *P);
+  bool skipHook(Value *V);
+  bool countHook(bool can_taint);
+
+  void collectSummaries(void);
+  void addSummary(Function *F_, StringRef Ranges);
+  void registerSummaries(void);
 
   void runOnFunction(void);
+  void runOnSummary(void);
   void runOnArgs(void);
   void runOnInstructions(void);
+  void assignSites(void);
+  void registerSites(void);
 
   void runOnLoad(BasicBlock *B, LoadInst *LI);
   void runOnStore(BasicBlock *B, StoreInst *SI);
+  void runOnField(Instruction *I, Value *TV);
   void runOnCall(BasicBlock *B, CallInst *CI);
   void runOnReturn(BasicBlock *B, ReturnInst *RI);
+  void clearAllocas(void);
   void runOnUnary(BasicBlock *B, UnaryInstruction *I);
   void runOnBinary(BasicBlock *B, BinaryOperator *I);
   void runOnIntrinsic(BasicBlock *B, MemIntrinsic *MI);
 
   Value *getTaint(Value *V);
   Value *LoadTaint(Instruction *I, Value *V);
+  Constant *getConstTaint(uint64_t Val);
+  Constant *getArgTaint(uint64_t i);
+  Constant *getRetTaint(void);
+  void registerConstTaints(void);
+  BasicBlock *CheckShadow(Instruction *I, Value *A, uint64_t S, Value *Force);
+  CallInst *CreateHook(Function *Hook, ArrayRef<Value *> Args);
+  Constant *getSiteVar(void);
+  Constant *getFieldLayout(const std::vector<uint64_t> &Layout);
+  Value *getLoadedTaint(LoadInst *LI);
 
   // Creates a function returning void on some arbitrary number of argument
   // types.
@@ -72,29 +214,13 @@ class FSliceModulePass : public ModulePass {
     return dyn_cast<Function>(M->getOrInsertFunction(name + suffix, FuncType));
   }
 
-  Value *CreateString(const char *str) {
-    auto &Val = StrValues[str];
-    if (Val) return Val;
-
-    auto GStr = new GlobalVariable(
-      *M,
-      ArrayType::get(IntegerType::get(*C, 8), strlen(str) + 1),
-      true,
-      GlobalValue::PrivateLinkage,
-      ConstantDataArray::getString(*C, str, true));
-
-    auto Zero = ConstantInt::get(IntPtrTy, 0, false);
-    std::vector<Value *> Indices = {Zero, Zero};
-    Val = ConstantExpr::getGetElementPtr(GStr, Indices);
-    return Val;
-  }
-
   Function *F;
   Module *M;
   LLVMContext *C;
   const DataLayout *DL;
 
   Type *IntPtrTy;
+  Type *TaintTy;
   Type *VoidTy;
   Type *VoidPtrTy;
   Instruction *AfterAlloca;
@@ -104,9 +230,60 @@ class FSliceModulePass : public ModulePass {
   std::vector<VSet> VSets;
   std::map<Value *,VSet *> VtoVSet;
   std::vector<Value *> IdxToVar;
-  std::map<const char *,Value *> StrValues;
+
+  // Loads that reuse the taint of an earlier load of the same memory, and
+  // loads whose taints are loaded once, before their loops. `LoadedTaints`
+  // holds the taints of the earlier loads, and `HoistedTaints` holds the
+  // hoisted hook calls of each loop preheader and address.
+  std::map<LoadInst *,LoadInst *> ReusedLoads;
+  std::map<LoadInst *,Instruction *> HoistedLoads;
+  std::map<LoadInst *,Instruction *> LoadedTaints;
+  std::map<std::pair<BasicBlock *,Value *>,Instruction *> HoistedTaints;
+
+  // Summarized functions, and the table of the opcodes of their summaries,
+  // which is filled in at startup.
+  std::map<Function *,Summary> Summaries;
+  GlobalVariable *SummaryOps;
+
+  // Field runs of the function, the run and index of each access in a run,
+  // and the array through which the taints of a run are passed to its hook.
+  std::deque<FieldRun> FieldRuns;
+  std::map<Instruction *,std::pair<FieldRun *,unsigned>> FieldOf;
+  AllocaInst *FieldTaints;
+  std::map<std::vector<uint64_t>,Constant *> FieldLayouts;
+
+  // Stack allocations whose shadow is cleared when the function returns, and
+  // their sizes.
+  std::vector<std::pair<AllocaInst *,uint64_t>> ClearedAllocas;
+
+  // The original instruction being instrumented, and the index of its basic
+  // block, to which the hooks called on its behalf are attributed.
+  Instruction *SiteI;
+  unsigned SiteB;
+  std::map<BasicBlock *,unsigned> BlockIds;
+  std::vector<std::pair<CallInst *,unsigned>> HookCalls;
+
+  // Descriptions of the hook call sites, where site `i` is `Sites[i - 1]`.
+  std::vector<std::string> Sites;
+
+  // Table of the taints of integer constants, which is filled in at startup.
+  GlobalVariable *ConstTaints;
+  std::vector<uint64_t> ConstVals;
+  std::map<uint64_t,uint64_t> ConstValToIdx;
+
+  std::deque<PNode> PNodes;
+  std::map<Value *,PNode *> VtoPNode;
+  std::map<Function *,PNode *> RetPNodes;
 
   int numVSets;
+  uint64_t NumHooks;
+  uint64_t NumPrunedHooks;
+  uint64_t NumCleanFuncs;
+  uint64_t NumFuncs;
+  uint64_t NumFieldRuns;
+  uint64_t NumFieldAccesses;
+  uint64_t NumReusedLoads;
+  uint64_t NumHoistedLoads;
 };
 
 FSliceModulePass::FSliceModulePass(void)
@@ -116,16 +293,31 @@ FSliceModulePass::FSliceModulePass(void)
       C(nullptr),
       DL(nullptr),
       IntPtrTy(nullptr),
+      TaintTy(nullptr),
       VoidTy(nullptr),
       VoidPtrTy(nullptr),
       AfterAlloca(nullptr),
-      numVSets(0) {}
+      SummaryOps(nullptr),
+      FieldTaints(nullptr),
+      SiteI(nullptr),
+      SiteB(0),
+      ConstTaints(nullptr),
+      numVSets(0),
+      NumHooks(0),
+      NumPrunedHooks(0),
+      NumCleanFuncs(0),
+      NumFuncs(0),
+      NumFieldRuns(0),
+      NumFieldAccesses(0),
+      NumReusedLoads(0),
+      NumHoistedLoads(0) {}
 
 bool FSliceModulePass::runOnModule(Module &M_) {
   M = &M_;
   C = &(M->getContext());
   DL = M->getDataLayout();
   IntPtrTy = Type::getIntNTy(*C,  DL->getPointerSizeInBits());
+  TaintTy = IntegerType::get(*C, 128);
   VoidTy = Type::getVoidTy(*C);
   VoidPtrTy = PointerType::getUnqual(IntegerType::getInt8Ty(*C));
 
@@ -146,36 +338,476 @@ bool FSliceModulePass::runOnModule(Module &M_) {
         F->setName("__fslice_malloc");
       } else if (F->getName() == "calloc") {
         F->setName("__fslice_calloc");
+      } else if (F->getName() == "realloc") {
+        F->setName("__fslice_realloc");
+      } else if (F->getName() == "free") {
+        F->setName("__fslice_free");
       }
-    } else {
-      runOnFunction();
     }
   }
+
+  if (PruneUntainted) analyzeModule();
+  collectSummaries();
+
+  for (auto &F_ : M->functions()) {
+    F = &F_;
+    if (!F->isDeclaration()) runOnFunction();
+  }
+  registerSummaries();
+  registerConstTaints();
+  registerSites();
+
+  if (PruneUntainted) {
+    errs() << "FSlice: pruned " << NumPrunedHooks << " of "
+           << (NumHooks + NumPrunedHooks) << " hook sites; "
+           << NumCleanFuncs << " of " << NumFuncs
+           << " functions have no tainted values.\n";
+  }
+  if (ReuseTaints) {
+    errs() << "FSlice: reused the taints of " << NumReusedLoads
+           << " loads; hoisted " << NumHoistedLoads << " loads out of loops.\n";
+  }
+  if (CoalesceFields) {
+    errs() << "FSlice: coalesced " << NumFieldAccesses << " field accesses "
+           << "into " << NumFieldRuns << " hook sites.\n";
+  }
   return true;
 }
 
+// Find the values and memory that can be reached by taint sources. This is a
+// flow- and context-insensitive analysis that unifies the nodes of values
+// that may flow into each other, so a node is tainted if any of its values
+// can be.
+void FSliceModulePass::analyzeModule(void) {
+  for (auto &G : M->globals()) {
+    if (G.hasInitializer()) {
+      analyzeInitializer(getPointee(&G), G.getInitializer());
+    }
+  }
+  for (auto &F_ : M->functions()) {
+    F = &F_;
+    for (auto &B : *F) {
+      for (auto &I : B) {
+        analyzeInstruction(&I);
+      }
+    }
+  }
+}
+
+// Unify the pointers in a global variable's initializer with the contents of
+// the global variable.
+void FSliceModulePass::analyzeInitializer(PNode *N, Constant *C) {
+  if (isa<GlobalValue>(C) || isa<ConstantExpr>(C)) {
+    unifyPNodes(N, getPNode(C));
+  } else {
+    for (auto &Op : C->operands()) {
+      analyzeInitializer(N, cast<Constant>(Op.get()));
+    }
+  }
+}
+
+void FSliceModulePass::analyzeInstruction(Instruction *I) {
+  if (auto LI = dyn_cast<LoadInst>(I)) {
+    unifyPNodes(getPNode(LI), getPointee(LI->getPointerOperand()));
+  } else if (auto SI = dyn_cast<StoreInst>(I)) {
+    unifyPNodes(getPNode(SI->getValueOperand()),
+                getPointee(SI->getPointerOperand()));
+  } else if (auto MT = dyn_cast<MemTransferInst>(I)) {
+    unifyPNodes(getPointee(MT->getRawDest()), getPointee(MT->getRawSource()));
+  } else if (auto MS = dyn_cast<MemSetInst>(I)) {
+    unifyPNodes(getPointee(MS->getRawDest()), getPNode(MS->getValue()));
+  } else if (auto CI = dyn_cast<CallInst>(I)) {
+    if (auto Callee = CI->getCalledFunction()) {
+      analyzeCall(CI, Callee);
+    } else {
+      for (auto &G : M->functions()) {
+        if (G.hasAddressTaken()) analyzeCall(CI, &G);
+      }
+    }
+  } else if (auto RI = dyn_cast<ReturnInst>(I)) {
+    if (auto RV = RI->getReturnValue()) {
+      unifyPNodes(getRetPNode(F), getPNode(RV));
+    }
+  } else {
+    auto N = getPNode(I);
+    for (auto &Op : I->operands()) {
+      unifyPNodes(N, getPNode(Op.get()));
+    }
+  }
+}
+
+// Analyze a call to `Callee`, which might be one of many possible targets of
+// an indirect call.
+void FSliceModulePass::analyzeCall(CallInst *CI, Function *Callee) {
+  auto Name = Callee->getName();
+  auto NumArgs = CI->getNumArgOperands();
+  if (!Callee->isDeclaration()) {
+    auto A = Callee->arg_begin();
+    for (auto i = 0U; i < NumArgs && A != Callee->arg_end(); ++i, ++A) {
+      unifyPNodes(getPNode(&*A), getPNode(CI->getArgOperand(i)));
+    }
+    unifyPNodes(getPNode(CI), getRetPNode(Callee));
+  } else if (Name == "__fslice_read_block" || Name == "__fslice_name" ||
+             Name == "__fslice_data") {
+    // Taint sources.
+    if (auto N = getPointee(CI->getArgOperand(0))) {
+      findPNode(N)->is_tainted = true;
+    }
+  } else if (Name == "__fslice_memcpy" || Name == "__fslice_memmove" ||
+             Name == "__fslice_strcpy") {
+    unifyPNodes(getPointee(CI->getArgOperand(0)),
+                getPointee(CI->getArgOperand(1)));
+    unifyPNodes(getPNode(CI), getPNode(CI->getArgOperand(0)));
+  } else if (Name == "__fslice_realloc") {
+    unifyPNodes(getPNode(CI), getPNode(CI->getArgOperand(0)));
+  } else if (Name == "__fslice_memset") {
+    unifyPNodes(getPointee(CI->getArgOperand(0)),
+                getPNode(CI->getArgOperand(1)));
+    unifyPNodes(getPNode(CI), getPNode(CI->getArgOperand(0)));
+  } else if (Callee->isIntrinsic()) {
+    for (auto i = 0U; i < NumArgs; ++i) {
+      unifyPNodes(getPNode(CI), getPNode(CI->getArgOperand(i)));
+    }
+
+  // Other runtime functions don't move data around. Assume that external
+  // functions can move data between their arguments, the memory that their
+  // arguments point to, and their return values.
+  } else if (!Name.startswith("__fslice_")) {
+    auto N = getPNode(CI);
+    if (!N) N = newPNode();
+    for (auto i = 0U; i < NumArgs; ++i) {
+      unifyPNodes(N, getPNode(CI->getArgOperand(i)));
+      unifyPNodes(N, getPointee(CI->getArgOperand(i)));
+    }
+  }
+}
+
+// Get the points-to node of a value. Returns `nullptr` for values that can't
+// be tainted or point to tainted memory, e.g. integer constants.
+PNode *FSliceModulePass::getPNode(Value *V) {
+  if (V->getType()->isVoidTy()) return nullptr;
+  if (!isa<Instruction>(V) && !isa<Argument>(V) && !isa<GlobalValue>(V) &&
+      !isa<ConstantExpr>(V)) {
+    return nullptr;
+  }
+  auto &N = VtoPNode[V];
+  if (!N) {
+    N = newPNode();
+    if (auto CE = dyn_cast<ConstantExpr>(V)) {
+      for (auto &Op : CE->operands()) {
+        unifyPNodes(N, getPNode(Op.get()));
+      }
+    }
+  }
+  return N;
+}
+
+// Get the points-to node of the values returned by a function.
+PNode *FSliceModulePass::getRetPNode(Function *F_) {
+  if (F_->getReturnType()->isVoidTy()) return nullptr;
+  auto &N = RetPNodes[F_];
+  if (!N) N = newPNode();
+  return N;
+}
+
+// Get the points-to node of the values stored in the memory pointed to by `V`.
+PNode *FSliceModulePass::getPointee(Value *V) {
+  auto N = getPNode(V);
+  if (!N) return nullptr;
+  N = findPNode(N);
+  if (!N->pointee) N->pointee = newPNode();
+  return findPNode(N->pointee);
+}
+
+// Create a new, untainted points-to node.
+PNode *FSliceModulePass::newPNode(void) {
+  PNodes.push_back({nullptr, nullptr, false});
+  auto N = &(PNodes.back());
+  N->rep = N;
+  return N;
+}
+
+// Get the representative of a points-to node, with path compression.
+PNode *FSliceModulePass::findPNode(PNode *N) {
+  while (N->rep != N) {
+    N = (N->rep = N->rep->rep);
+  }
+  return N;
+}
+
+// Unify two points-to nodes, and then their pointees.
+void FSliceModulePass::unifyPNodes(PNode *N1, PNode *N2) {
+  std::vector<std::pair<PNode *, PNode *>> Work = {{N1, N2}};
+  while (!Work.empty()) {
+    N1 = Work.back().first;
+    N2 = Work.back().second;
+    Work.pop_back();
+    if (!N1 || !N2) continue;
+    N1 = findPNode(N1);
+    N2 = findPNode(N2);
+    if (N1 == N2) continue;
+    if (N1 > N2) std::swap(N1, N2);
+    N2->rep = N1;
+    N1->is_tainted = N1->is_tainted || N2->is_tainted;
+    if (!N1->pointee) {
+      N1->pointee = N2->pointee;
+    } else if (N2->pointee) {
+      Work.push_back({N1->pointee, N2->pointee});
+    }
+  }
+}
+
+// Returns true if the value `V` can derive from a taint source.
+bool FSliceModulePass::mayBeTainted(Value *V) {
+  if (!PruneUntainted) return true;
+  auto N = getPNode(V);
+  return N && findPNode(N)->is_tainted;
+}
+
+// Returns true if the memory pointed to by `P` can be tainted.
+bool FSliceModulePass::mayPointToTaint(Value *P) {
+  if (!PruneUntainted) return true;
+  auto N = getPointee(P);
+  return N && N->is_tainted;
+}
+
+// Returns true if the hook that tracks the taint of `V` can be left out.
+bool FSliceModulePass::skipHook(Value *V) {
+  if (V->getType()->isFPOrFPVectorTy()) return true;
+  return countHook(mayBeTainted(V));
+}
+
+// Count a hook site. Returns true if the hook can be left out because it
+// can't see any taint.
+bool FSliceModulePass::countHook(bool can_taint) {
+  if (can_taint) {
+    ++NumHooks;
+  } else {
+    ++NumPrunedHooks;
+  }
+  return !can_taint;
+}
+
+// Find the functions to summarize, which are named by `-fslice-summarize` or
+// annotated with `fslice_summary`, and create the table of their opcodes.
+void FSliceModulePass::collectSummaries(void) {
+  for (auto &Spec : SummarizeFuncs) {
+    auto Name = StringRef(Spec).split(':').first;
+    auto F_ = M->getFunction(Name);
+    if (!F_ || F_->isDeclaration()) {
+      errs() << "FSlice: can't summarize undefined function " << Name << ".\n";
+      continue;
+    }
+    addSummary(F_, StringRef(Spec).substr(Name.size()));
+  }
+
+  // Annotations are `{function, string, file, line}` structs.
+  if (auto Annots = M->getNamedGlobal("llvm.global.annotations")) {
+    auto Entries = dyn_cast<ConstantArray>(Annots->getInitializer());
+    for (auto i = 0U; Entries && i < Entries->getNumOperands(); ++i) {
+      auto Entry = dyn_cast<ConstantStruct>(Entries->getOperand(i));
+      if (!Entry || 2 > Entry->getNumOperands()) continue;
+      auto F_ = dyn_cast<Function>(Entry->getOperand(0)->stripPointerCasts());
+      auto GStr = dyn_cast<GlobalVariable>(
+          Entry->getOperand(1)->stripPointerCasts());
+      if (!F_ || !GStr || !GStr->hasInitializer()) continue;
+      auto Str = dyn_cast<ConstantDataSequential>(GStr->getInitializer());
+      if (!Str || !Str->isCString()) continue;
+      auto Annot = Str->getAsCString();
+      auto Ranges = Annot.substr(strlen("fslice_summary"));
+      if (Annot.startswith("fslice_summary") &&
+          (Ranges.empty() || Ranges.startswith(":"))) {
+        addSummary(F_, Ranges);
+      }
+    }
+  }
+
+  if (Summaries.empty()) return;
+  auto TableTy = ArrayType::get(IntPtrTy, Summaries.size());
+  SummaryOps = new GlobalVariable(
+      *M, TableTy, false, GlobalValue::PrivateLinkage,
+      ConstantAggregateZero::get(TableTy), "__fslice_summary_ops");
+}
+
+// Returns the `i`th argument of `F_`.
+static Argument *GetArg(Function *F_, unsigned i) {
+  auto A = F_->arg_begin();
+  std::advance(A, i);
+  return &*A;
+}
+
+// Summarize the function `F_`, where `Ranges` is a list of `:ptr:size` pairs
+// of argument numbers.
+void FSliceModulePass::addSummary(Function *F_, StringRef Ranges) {
+  if (Summaries.count(F_)) return;
+  Summary S = {static_cast<unsigned>(Summaries.size()), {}};
+  SmallVector<StringRef, 8> Args;
+  Ranges.split(Args, ":");
+  auto IsValid = Args[0].empty() && 1 == Args.size() % 2;
+  for (auto i = 1U; IsValid && i < Args.size(); i += 2) {
+    unsigned Ptr = 0;
+    unsigned Size = kSummaryString;
+    IsValid = !Args[i].getAsInteger(10, Ptr) && Ptr < F_->arg_size() &&
+              GetArg(F_, Ptr)->getType()->isPointerTy();
+    if (IsValid && "s" != Args[i + 1]) {
+      IsValid = !Args[i + 1].getAsInteger(10, Size) &&
+                Size < F_->arg_size() &&
+                GetArg(F_, Size)->getType()->isIntegerTy();
+    }
+    S.Ranges.push_back({Ptr, Size});
+  }
+  if (!IsValid) {
+    report_fatal_error("FSlice: invalid summary of " + F_->getName() + ": " +
+                       Ranges);
+  }
+  Summaries[F_] = S;
+}
+
+// Create the table of the names of the summarized functions, along with a
+// module constructor that gives it to the runtime, which fills in the table
+// of their opcodes. The constructor runs at `kRegisterPriority`, i.e. before
+// the module's own constructors can call a summary.
+void FSliceModulePass::registerSummaries(void) {
+  if (Summaries.empty()) return;
+
+  auto Zero = ConstantInt::get(IntPtrTy, 0, false);
+  std::vector<Value *> Indices = {Zero, Zero};
+  std::vector<Constant *> Names(Summaries.size());
+  for (auto &Entry : Summaries) {
+    auto Str = ConstantDataArray::getString(*C, Entry.first->getName(), true);
+    auto GStr = new GlobalVariable(*M, Str->getType(), true,
+                                   GlobalValue::PrivateLinkage, Str);
+    Names[Entry.second.Index] = ConstantExpr::getGetElementPtr(GStr, Indices);
+  }
+  auto TableTy = ArrayType::get(VoidPtrTy, Names.size());
+  auto Table = new GlobalVariable(
+      *M, TableTy, true, GlobalValue::PrivateLinkage,
+      ConstantArray::get(TableTy, Names), "__fslice_summary_names");
+
+  auto Ctor = Function::Create(FunctionType::get(VoidTy, false),
+                               GlobalValue::InternalLinkage,
+                               "__fslice_init_summaries", M);
+  auto B = BasicBlock::Create(*C, "", Ctor);
+  auto RegisterFunc = CreateFunc(VoidTy, "__fslice_register_summaries", "",
+                                 PointerType::getUnqual(VoidPtrTy),
+                                 PointerType::getUnqual(IntPtrTy), IntPtrTy);
+  std::vector<Value *> args = {
+      ConstantExpr::getGetElementPtr(Table, Indices),
+      ConstantExpr::getGetElementPtr(SummaryOps, Indices),
+      ConstantInt::get(IntPtrTy, Names.size(), false)};
+  CallInst::Create(RegisterFunc, args, "", B);
+  ReturnInst::Create(*C, B);
+  appendToGlobalCtors(*M, Ctor, kRegisterPriority);
+}
+
 // Instrument every instruction in a function.
 void FSliceModulePass::runOnFunction(void) {
+  if (Summaries.count(F)) {
+    runOnSummary();
+    ++NumFuncs;
+    return;
+  }
   numVSets = 0;
   collectInstructions();
   initVSets();
   combineVSets();
   labelVSets();
   allocaVSetArray();
+  reuseLoadTaints();
+  collectFieldRuns();
+  collectClearedAllocas();
   runOnArgs();
   runOnInstructions();
+  clearAllocas();
+  assignSites();
+  ++NumFuncs;
+  if (!numVSets) ++NumCleanFuncs;
   ArgToVSet.clear();
   IIs.clear();
+  BlockIds.clear();
+  HookCalls.clear();
+  SiteI = nullptr;
   VSets.clear();
   VtoVSet.clear();
   IdxToVar.clear();
+  ReusedLoads.clear();
+  HoistedLoads.clear();
+  LoadedTaints.clear();
+  HoistedTaints.clear();
+  FieldRuns.clear();
+  FieldOf.clear();
+  FieldTaints = nullptr;
+  ClearedAllocas.clear();
+}
+
+// Instrument a summarized function. Instead of instrumenting its instructions,
+// its entry calls the summary hook on the function's arguments and on the
+// ranges of input memory that they point to, and each return returns the
+// taint of the summary.
+void FSliceModulePass::runOnSummary(void) {
+  auto &S = Summaries[F];
+  auto FirstI = &*(F->getEntryBlock().begin());
+  auto TablePtrTy = PointerType::getUnqual(IntPtrTy);
+  SiteI = FirstI;
+  SiteB = 0;
+
+  Value *Ranges = ConstantPointerNull::get(TablePtrTy);
+  if (!S.Ranges.empty()) {
+    Ranges = new AllocaInst(
+        IntPtrTy, ConstantInt::get(IntPtrTy, S.Ranges.size() * 2, false), "",
+        FirstI);
+    auto i = 0UL;
+    for (auto &R : S.Ranges) {
+      Value *Size = ConstantInt::get(IntPtrTy, ~0ULL, false);
+      if (kSummaryString != R.second) {
+        Size = CastInst::CreateIntegerCast(GetArg(F, R.second), IntPtrTy,
+                                           false, "", FirstI);
+      }
+      std::vector<Value *> Range = {
+          CastInst::CreatePointerCast(GetArg(F, R.first), IntPtrTy, "",
+                                      FirstI),
+          Size};
+      for (auto V : Range) {
+        auto Slot = GetElementPtrInst::Create(
+            Ranges, {ConstantInt::get(IntPtrTy, i++, false)}, "", FirstI);
+        new StoreInst(V, Slot, FirstI);
+      }
+    }
+  }
+
+  std::vector<Value *> Indices = {
+      ConstantInt::get(IntPtrTy, 0, false),
+      ConstantInt::get(IntPtrTy, S.Index, false)};
+  auto Op = new LoadInst(ConstantExpr::getGetElementPtr(SummaryOps, Indices),
+                         "", FirstI);
+  auto NumArgs = std::min<uint64_t>(F->arg_size(), kNumArgTaints);
+  std::vector<Value *> args = {
+      Op, ConstantInt::get(IntPtrTy, NumArgs, false), Ranges,
+      ConstantInt::get(IntPtrTy, S.Ranges.size(), false)};
+  auto SummaryFunc = CreateFunc(TaintTy, "__fslice_summary", "", IntPtrTy,
+                                IntPtrTy, TablePtrTy, IntPtrTy);
+  auto T = CreateHook(SummaryFunc, args);
+  T->insertBefore(FirstI);
+
+  if (!F->getReturnType()->isVoidTy()) {
+    for (auto &B : *F) {
+      if (auto RI = dyn_cast<ReturnInst>(B.getTerminator())) {
+        new StoreInst(T, getRetTaint(), RI);
+      }
+    }
+  }
+  assignSites();
+  HookCalls.clear();
+  SiteI = nullptr;
 }
 
 // Collect a list of all instructions. We'll be adding all sorts of new
 // instructions in so having a list makes it easy to operate on just the
 // originals.
 void FSliceModulePass::collectInstructions(void) {
+  auto i = 0U;
   for (auto &B : *F) {
+    BlockIds[&B] = i++;
     for (auto &I : B) {
       IIs.push_back({&B, &I});
     }
@@ -242,10 +874,18 @@ VSet *FSliceModulePass::getVSet(VSet *VSet) {
 }
 
 // Assign array indices to each VSet. This labels all variables from 0 to N-1.
+// Variables that can't be tainted aren't labeled.
 void FSliceModulePass::labelVSets(void) {
-  for (auto &rVSet : VSets) {
-    auto pVSet = getVSet(&rVSet);
-    if (-1 == pVSet->index) {
+  auto i = 0UL;
+  for (auto &A : F->args()) {
+    auto pVSet = getVSet(&(VSets[i++]));
+    if (-1 == pVSet->index && mayBeTainted(&A)) {
+      pVSet->index = numVSets++;
+    }
+  }
+  for (auto &II : IIs) {
+    auto pVSet = getVSet(&(VSets[i++]));
+    if (-1 == pVSet->index && mayBeTainted(II.I)) {
       pVSet->index = numVSets++;
     }
   }
@@ -258,73 +898,556 @@ void FSliceModulePass::allocaVSetArray(void) {
   auto &IList = B.getInstList();
   auto &FirstI = *IList.begin();
   for (auto i = 0; i < numVSets; ++i) {
-    auto TaintVar = new AllocaInst(IntPtrTy);
+    auto TaintVar = new AllocaInst(TaintTy);
     IList.insert(FirstI, TaintVar);
-    IList.insert(FirstI, new StoreInst(ConstantInt::get(IntPtrTy, 0, false),
+    IList.insert(FirstI, new StoreInst(ConstantInt::get(TaintTy, 0, false),
                                        TaintVar));
     IdxToVar.push_back(TaintVar);
   }
   AfterAlloca = &FirstI;
 }
 
-// Instrument the arguments.
+// Returns the pointer that `P` is a constant offset from, along with that
+// offset.
+static Value *FieldBase(const DataLayout *DL, Value *P, int64_t &Offset) {
+  APInt Off(DL->getPointerSizeInBits(), 0);
+  auto Base = P->stripAndAccumulateInBoundsConstantOffsets(*DL, Off);
+  Offset = Off.getSExtValue();
+  return Base;
+}
+
+// Returns the size of a loaded/stored object.
+static uint64_t LoadStoreSize(const DataLayout *DL, Value *P) {
+  PointerType *PT = dyn_cast<PointerType>(P->getType());
+  return DL->getTypeStoreSize(PT->getElementType());
+}
+
+// Returns true if the `S1` bytes at `P1` and the `S2` bytes at `P2` might
+// overlap. Distinct stack allocations and globals never overlap.
+static bool MayOverlap(const DataLayout *DL, Value *P1, uint64_t S1,
+                       Value *P2, uint64_t S2) {
+  int64_t Offset1 = 0;
+  int64_t Offset2 = 0;
+  auto Base1 = FieldBase(DL, P1, Offset1);
+  auto Base2 = FieldBase(DL, P2, Offset2);
+  if (Base1 == Base2) {
+    return Offset1 < Offset2 + static_cast<int64_t>(S2) &&
+           Offset2 < Offset1 + static_cast<int64_t>(S1);
+  }
+  auto IsObject = [] (Value *Base) {
+    return isa<AllocaInst>(Base) || isa<GlobalVariable>(Base);
+  };
+  return !IsObject(Base1) || !IsObject(Base2);
+}
+
+// Find the loads whose hooks are redundant. The shadow of memory only changes
+// at instrumented stores and at calls, so a load of an address that is still
+// available, i.e. that was loaded earlier in the same block, or in the unique
+// predecessor of the block, reuses the taint of the earlier load. A load of a
+// loop-invariant address in a loop that doesn't change the shadow calls its
+// hook once, in the loop's preheader. The load must run on every trip through
+// the loop, i.e. its block must dominate every exit of the loop, as the hook
+// traces the loaded object, and hoisting a load that might not run would add
+// to the slice.
+void FSliceModulePass::reuseLoadTaints(void) {
+  if (!ReuseTaints) return;
+
+  std::set<BasicBlock *> WriteBlocks;
+  for (auto &II : IIs) {
+    if (auto SI = dyn_cast<StoreInst>(II.I)) {
+      if (mayPointToTaint(SI->getPointerOperand())) WriteBlocks.insert(II.B);
+    } else if (!isa<LoadInst>(II.I) && !isa<DbgInfoIntrinsic>(II.I) &&
+               II.I->mayWriteToMemory()) {
+      WriteBlocks.insert(II.B);
+    }
+  }
+
+  DominatorTree DT;
+  DT.recalculate(*F);
+  LoopInfoBase<BasicBlock, Loop> Loops;
+  Loops.Analyze(DT);
+  std::map<Loop *,bool> LoopWrites;
+  auto WritesShadow = [&] (Loop *L) -> bool {
+    auto It = LoopWrites.find(L);
+    if (It != LoopWrites.end()) return It->second;
+    auto &Writes = LoopWrites[L];
+    for (auto LB : L->getBlocks()) Writes = Writes || WriteBlocks.count(LB);
+    return Writes;
+  };
+  auto AlwaysRuns = [&] (BasicBlock *B, Loop *L) -> bool {
+    SmallVector<BasicBlock *, 4> Exiting;
+    L->getExitingBlocks(Exiting);
+    if (Exiting.empty()) return false;
+    for (auto EB : Exiting) {
+      if (!DT.dominates(B, EB)) return false;
+    }
+    return true;
+  };
+
+  std::map<BasicBlock *,std::vector<LoadInst *>> AvailOut;
+  std::vector<LoadInst *> Avail;
+  BasicBlock *LastB = nullptr;
+  for (auto &II : IIs) {
+    if (II.B != LastB) {
+      if (LastB) AvailOut[LastB] = Avail;
+      Avail.clear();
+      auto Pred = II.B->getSinglePredecessor();
+      if (Pred && AvailOut.count(Pred)) Avail = AvailOut[Pred];
+      LastB = II.B;
+    }
+
+    if (auto SI = dyn_cast<StoreInst>(II.I)) {
+      auto P = SI->getPointerOperand();
+      if (!mayPointToTaint(P)) continue;
+      auto S = LoadStoreSize(DL, P);
+      Avail.erase(std::remove_if(Avail.begin(), Avail.end(),
+                                 [=] (LoadInst *LI) {
+        auto LP = LI->getPointerOperand();
+        return MayOverlap(DL, P, S, LP, LoadStoreSize(DL, LP));
+      }), Avail.end());
+      continue;
+    }
+    auto LI = dyn_cast<LoadInst>(II.I);
+    if (!LI) {
+      if (!isa<DbgInfoIntrinsic>(II.I) && II.I->mayWriteToMemory()) {
+        Avail.clear();
+      }
+      continue;
+    }
+    if (LI->getType()->isFPOrFPVectorTy() || !mayBeTainted(LI) ||
+        !LI->isSimple()) {
+      continue;
+    }
+
+    auto P = LI->getPointerOperand();
+    auto Earlier = std::find_if(Avail.begin(), Avail.end(),
+                                [=] (LoadInst *ELI) {
+      return ELI->getPointerOperand() == P;
+    });
+    if (Earlier != Avail.end()) {
+      ReusedLoads[LI] = *Earlier;
+      ++NumReusedLoads;
+      continue;
+    }
+
+    Loop *Outer = nullptr;
+    for (auto L = Loops.getLoopFor(II.B); L; L = L->getParentLoop()) {
+      if (!L->isLoopInvariant(P) || !L->getLoopPreheader() ||
+          WritesShadow(L) || !AlwaysRuns(II.B, L)) {
+        break;
+      }
+      Outer = L;
+    }
+    if (Outer) {
+      SiteI = LI;
+      SiteB = BlockIds[II.B];
+      hoistLoadTaint(LI, Outer->getLoopPreheader());
+    }
+    Avail.push_back(LI);
+  }
+  SiteI = nullptr;
+}
+
+// Call the load hook of `LI` at the end of the loop preheader `Preheader`.
+// Loads of the same address in the same loop share the hook call.
+void FSliceModulePass::hoistLoadTaint(LoadInst *LI, BasicBlock *Preheader) {
+  auto P = LI->getPointerOperand();
+  auto &T = HoistedTaints[{Preheader, P}];
+  if (!T) {
+    auto &IList = Preheader->getInstList();
+    auto Term = Preheader->getTerminator();
+    auto A = CastInst::CreatePointerCast(P, IntPtrTy);
+    auto LoadFunc = CreateFunc(TaintTy, "__fslice_load",
+                               std::to_string(LoadStoreSize(DL, P)),
+                               IntPtrTy);
+    T = CreateHook(LoadFunc, {A});
+    IList.insert(Term, A);
+    IList.insert(Term, T);
+  }
+  HoistedLoads[LI] = T;
+  ++NumHoistedLoads;
+}
+
+// Get the taint of the instrumented load `LI`, as loaded from its taint
+// variable right after `LI`.
+Value *FSliceModulePass::getLoadedTaint(LoadInst *LI) {
+  auto &T = LoadedTaints[LI];
+  if (!T) {
+    T = new LoadInst(getTaint(LI));
+    LI->getParent()->getInstList().insertAfter(LI, T);
+  }
+  return T;
+}
+
+// Find the runs of loads, or of stores, of fields of the same object, e.g. of
+// a struct that is initialized or copied field by field. Each run is
+// instrumented with one hook. A run ends at anything else that reads or
+// writes the shadow memory, i.e. calls and loads or stores of other kinds.
+void FSliceModulePass::collectFieldRuns(void) {
+  if (!CoalesceFields) return;
+  FieldRun Run = {nullptr, false, 0, 0, {}, {}};
+  auto EndRun = [&] (void) {
+    if (2 <= Run.Accesses.size()) {
+      FieldRuns.push_back(Run);
+      auto R = &(FieldRuns.back());
+      for (auto i = 0U; i < R->Accesses.size(); ++i) {
+        FieldOf[R->Accesses[i]] = {R, i};
+      }
+      ++NumFieldRuns;
+      NumFieldAccesses += R->Accesses.size();
+    }
+    Run.Accesses.clear();
+    Run.Layout.clear();
+  };
+
+  BasicBlock *LastB = nullptr;
+  for (auto &II : IIs) {
+    if (II.B != LastB) EndRun();
+    LastB = II.B;
+
+    // Loads and stores that aren't instrumented don't end runs.
+    Value *P = nullptr;
+    auto IsStore = false;
+    auto IsSimple = false;
+    if (auto LI = dyn_cast<LoadInst>(II.I)) {
+      if (LI->getType()->isFPOrFPVectorTy() || !mayBeTainted(LI) ||
+          ReusedLoads.count(LI) || HoistedLoads.count(LI)) {
+        continue;
+      }
+      P = LI->getPointerOperand();
+      IsSimple = LI->isSimple();
+    } else if (auto SI = dyn_cast<StoreInst>(II.I)) {
+      P = SI->getPointerOperand();
+      if (!mayPointToTaint(P)) continue;
+      IsStore = true;
+      IsSimple = SI->isSimple();
+    } else {
+      if (!isa<DbgInfoIntrinsic>(II.I) && II.I->mayReadOrWriteMemory()) {
+        EndRun();
+      }
+      continue;
+    }
+    if (!IsSimple) {
+      EndRun();
+      continue;
+    }
+
+    int64_t Offset = 0;
+    auto Base = FieldBase(DL, P, Offset);
+    int64_t Size = LoadStoreSize(DL, P);
+    if (Run.Accesses.empty() || Run.Base != Base || Run.IsStore != IsStore ||
+        kMaxFieldRun <= Run.Accesses.size() ||
+        static_cast<int64_t>(kMaxFieldSpan) <
+            std::max(Run.End, Offset + Size) - std::min(Run.Begin, Offset)) {
+      EndRun();
+      Run.Base = Base;
+      Run.IsStore = IsStore;
+      Run.Begin = Offset;
+      Run.End = Offset + Size;
+    }
+    Run.Begin = std::min(Run.Begin, Offset);
+    Run.End = std::max(Run.End, Offset + Size);
+    Run.Accesses.push_back(II.I);
+    Run.Layout.push_back(static_cast<uint64_t>(Offset));
+    Run.Layout.push_back(static_cast<uint64_t>(Size));
+  }
+  EndRun();
+
+  if (!FieldRuns.empty()) {
+    auto &IList = F->getEntryBlock().getInstList();
+    FieldTaints = new AllocaInst(
+        TaintTy, ConstantInt::get(IntPtrTy, kMaxFieldRun, false));
+    IList.insert(IList.begin(), FieldTaints);
+  }
+}
+
+// Instrument the arguments. Argument taints are read from, and then cleared
+// out of, the caller-filled argument slots.
 void FSliceModulePass::runOnArgs(void) {
   if (!AfterAlloca) return;
   auto &IList = AfterAlloca->getParent()->getInstList();
-  auto LoadFunc = CreateFunc(IntPtrTy, "__fslice_load_arg", "", IntPtrTy);
+  auto Zero = ConstantInt::get(TaintTy, 0, false);
   for (auto &A : F->args()) {
+    if (kNumArgTaints <= A.getArgNo() || skipHook(&A)) continue;
     if (auto TA = getTaint(&A)) {
-      auto T = CallInst::Create(
-          LoadFunc, {ConstantInt::get(IntPtrTy, A.getArgNo(), false)});
+      auto Slot = getArgTaint(A.getArgNo());
+      auto T = new LoadInst(Slot);
       IList.insert(AfterAlloca, T);
       IList.insert(AfterAlloca, new StoreInst(T, TA));
+      IList.insert(AfterAlloca, new StoreInst(Zero, Slot));
     }
   }
 }
 
+// Get a pointer to the `i`th thread-local argument taint slot.
+Constant *FSliceModulePass::getArgTaint(uint64_t i) {
+  auto Args = dyn_cast<GlobalVariable>(M->getOrInsertGlobal(
+      "__fslice_args", ArrayType::get(TaintTy, kNumArgTaints)));
+  Args->setThreadLocal(true);
+  std::vector<Value *> Indices = {ConstantInt::get(IntPtrTy, 0, false),
+                                  ConstantInt::get(IntPtrTy, i, false)};
+  return ConstantExpr::getGetElementPtr(Args, Indices);
+}
+
+// Get a pointer to the thread-local return value taint.
+Constant *FSliceModulePass::getRetTaint(void) {
+  auto Ret = dyn_cast<GlobalVariable>(
+      M->getOrInsertGlobal("__fslice_ret", TaintTy));
+  Ret->setThreadLocal(true);
+  return Ret;
+}
+
 // Instrument the original instructions.
 void FSliceModulePass::runOnInstructions(void) {
   for (auto II : IIs) {
+    SiteI = II.I;
+    SiteB = BlockIds[II.B];
+
+    // Inline shadow checks split blocks, so `II.B` might be stale.
+    auto B = II.I->getParent();
     if (LoadInst *LI = dyn_cast<LoadInst>(II.I)) {
-      runOnLoad(II.B, LI);
+      runOnLoad(B, LI);
     } else if (StoreInst *SI = dyn_cast<StoreInst>(II.I)) {
-      runOnStore(II.B, SI);
+      runOnStore(B, SI);
     } else if (MemIntrinsic *MI = dyn_cast<MemIntrinsic>(II.I)) {
-      runOnIntrinsic(II.B, MI);
+      runOnIntrinsic(B, MI);
     } else if (CallInst *CI = dyn_cast<CallInst>(II.I)) {
-      runOnCall(II.B, CI);
+      runOnCall(B, CI);
     } else if (ReturnInst *RI = dyn_cast<ReturnInst>(II.I)) {
-      runOnReturn(II.B, RI);
+      runOnReturn(B, RI);
     //} else if (UnaryInstruction *UI = dyn_cast<UnaryInstruction>(II.I)) {
-    //  runOnUnary(II.B, UI);
+    //  runOnUnary(B, UI);
     } else if (BinaryOperator *BI = dyn_cast<BinaryOperator>(II.I)) {
-      runOnBinary(II.B, BI);
+      runOnBinary(B, BI);
     }
   }
 }
 
-// Returns the size of a loaded/stored object.
-static uint64_t LoadStoreSize(const DataLayout *DL, Value *P) {
-  PointerType *PT = dyn_cast<PointerType>(P->getType());
-  return DL->getTypeStoreSize(PT->getElementType());
-}
-
 // Instrument a single instruction.
 void FSliceModulePass::runOnLoad(BasicBlock *B, LoadInst *LI) {
+  if (skipHook(LI)) return;
   if (auto TV = getTaint(LI)) {
     auto &IList = B->getInstList();
+    if (ReusedLoads.count(LI)) {
+      IList.insert(LI, new StoreInst(getLoadedTaint(ReusedLoads[LI]), TV));
+      return;
+    } else if (HoistedLoads.count(LI)) {
+      IList.insert(LI, new StoreInst(HoistedLoads[LI], TV));
+      return;
+    } else if (FieldOf.count(LI)) {
+      runOnField(LI, TV);
+      return;
+    }
     auto P = LI->getPointerOperand();
     auto S = LoadStoreSize(DL, P);
     auto A = CastInst::CreatePointerCast(P, IntPtrTy);
-    auto LoadFunc = CreateFunc(IntPtrTy, "__fslice_load", std::to_string(S),
+    auto LoadFunc = CreateFunc(TaintTy, "__fslice_load", std::to_string(S),
                                IntPtrTy);
-    auto T = CallInst::Create(LoadFunc, {A});
+    auto T = CreateHook(LoadFunc, {A});
     IList.insert(LI, A);
-    IList.insert(LI, T);
-    IList.insert(LI, new StoreInst(T, TV));
+    if (InlineShadowChecks) {
+      IList.insert(LI, new StoreInst(ConstantInt::get(TaintTy, 0, false), TV));
+      auto Slow = CheckShadow(LI, A, S, nullptr);
+      auto &SlowIList = Slow->getInstList();
+      SlowIList.insert(SlowIList.begin(), T);
+      SlowIList.insert(Slow->getTerminator(), new StoreInst(T, TV));
+    } else {
+      IList.insert(LI, T);
+      IList.insert(LI, new StoreInst(T, TV));
+    }
   }
 }
 
+// Instrument a load or store of a field run. The first load of a run calls
+// the hook that loads the taints of all fields of the run into `FieldTaints`,
+// and each load then takes its taint from there. Each store puts its taint
+// into `FieldTaints`, and the last store calls the hook that stores them all.
+// Field runs aren't checked inline, as one hook replaces many.
+void FSliceModulePass::runOnField(Instruction *I, Value *TV) {
+  auto &IList = I->getParent()->getInstList();
+  auto Run = FieldOf[I].first;
+  auto i = FieldOf[I].second;
+  auto NumFields = Run->Accesses.size();
+  auto Slot = GetElementPtrInst::Create(
+      FieldTaints, {ConstantInt::get(IntPtrTy, i, false)});
+
+  const char *HookName = nullptr;
+  if (Run->IsStore) {
+    auto T = LoadTaint(I, cast<StoreInst>(I)->getValueOperand());
+    IList.insert(I, Slot);
+    IList.insert(I, new StoreInst(T, Slot));
+    if (i + 1 == NumFields) HookName = "__fslice_store_fields";
+  } else if (!i) {
+    HookName = "__fslice_load_fields";
+  }
+
+  if (HookName) {
+    auto TablePtrTy = PointerType::getUnqual(IntPtrTy);
+    auto FieldsFunc = CreateFunc(VoidTy, HookName, "", IntPtrTy, TablePtrTy,
+                                 PointerType::getUnqual(TaintTy), IntPtrTy);
+    auto A = CastInst::CreatePointerCast(Run->Base, IntPtrTy);
+    std::vector<Value *> args = {
+        A, getFieldLayout(Run->Layout), FieldTaints,
+        ConstantInt::get(IntPtrTy, NumFields, false)};
+    IList.insert(I, A);
+    IList.insert(I, CreateHook(FieldsFunc, args));
+  }
+
+  if (!Run->IsStore) {
+    auto T = new LoadInst(Slot);
+    IList.insert(I, Slot);
+    IList.insert(I, T);
+    IList.insert(I, new StoreInst(T, TV));
+  }
+}
+
+// Get a pointer to the constant table that holds the layout of a field run.
+// Runs with the same layout share a table.
+Constant *FSliceModulePass::getFieldLayout(
+    const std::vector<uint64_t> &Layout) {
+  auto &Table = FieldLayouts[Layout];
+  if (Table) return Table;
+
+  auto Init = ConstantDataArray::get(*C, Layout);
+  auto G = new GlobalVariable(*M, Init->getType(), true,
+                              GlobalValue::PrivateLinkage, Init,
+                              "__fslice_field_layout");
+  auto Zero = ConstantInt::get(IntPtrTy, 0, false);
+  std::vector<Value *> Indices = {Zero, Zero};
+  Table = ConstantExpr::getGetElementPtr(G, Indices);
+  return Table;
+}
+
+// Split the block containing `I` so that the runtime hook placed in the
+// returned block only runs if the `S` bytes of memory at the address `A`
+// might be tainted, or if `Force` is true. This mirrors the runtime's shadow
+// page directory, where a null directory or directory entry means that the
+// whole page is untainted. Everything before `I` runs before the check.
+BasicBlock *FSliceModulePass::CheckShadow(Instruction *I, Value *A,
+                                          uint64_t S, Value *Force) {
+  auto Head = I->getParent();
+  auto Join = Head->splitBasicBlock(I);
+  Head->getTerminator()->eraseFromParent();
+
+  auto Slow = BasicBlock::Create(*C, "", F, Join);
+  BranchInst::Create(Join, Slow);
+
+  auto CheckDir = Head;
+  if (Force) {
+    CheckDir = BasicBlock::Create(*C, "", F, Slow);
+    BranchInst::Create(Slow, CheckDir, Force, Head);
+  }
+
+  auto EntryPtrTy = PointerType::getUnqual(IntPtrTy);
+  auto ShadowDir = M->getOrInsertGlobal("__fslice_shadow", EntryPtrTy);
+  auto Dir = new LoadInst(ShadowDir, "", CheckDir);
+  auto DirIsNull = new ICmpInst(*CheckDir, ICmpInst::ICMP_EQ, Dir,
+                                ConstantPointerNull::get(EntryPtrTy));
+  auto CheckPages = BasicBlock::Create(*C, "", F, Slow);
+  BranchInst::Create(Join, CheckPages, DirIsNull, CheckDir);
+
+  // Check the directory entries of the pages holding the first and last
+  // bytes of memory.
+  auto Last = BinaryOperator::Create(
+      Instruction::Add, A, ConstantInt::get(IntPtrTy, S - 1, false), "",
+      CheckPages);
+  Value *Pages = nullptr;
+  for (auto Addr : {A, static_cast<Value *>(Last)}) {
+    auto Shifted = BinaryOperator::Create(
+        Instruction::LShr, Addr,
+        ConstantInt::get(IntPtrTy, kShadowPageShift, false), "", CheckPages);
+    auto Index = BinaryOperator::Create(
+        Instruction::And, Shifted,
+        ConstantInt::get(IntPtrTy, kShadowNumPages - 1, false), "",
+        CheckPages);
+    auto EntryPtr = GetElementPtrInst::Create(Dir, {Index}, "", CheckPages);
+    Value *Entry = new LoadInst(EntryPtr, "", CheckPages);
+    if (Pages) {
+      Entry = BinaryOperator::Create(Instruction::Or, Pages, Entry, "",
+                                     CheckPages);
+    }
+    Pages = Entry;
+  }
+  auto IsClean = new ICmpInst(*CheckPages, ICmpInst::ICMP_EQ, Pages,
+                              ConstantInt::get(IntPtrTy, 0, false));
+  BranchInst::Create(Join, Slow, IsClean, CheckPages);
+  return Slow;
+}
+
+// Create a call to a runtime hook on behalf of the original instruction that
+// is being instrumented. The call shares that instruction's debug location.
+CallInst *FSliceModulePass::CreateHook(Function *Hook,
+                                       ArrayRef<Value *> Args) {
+  auto CI = CallInst::Create(Hook, Args);
+  if (SiteI) CI->setDebugLoc(SiteI->getDebugLoc());
+  HookCalls.push_back({CI, SiteB});
+  return CI;
+}
+
+// Get a pointer to the thread-local id of the site of the current hook call.
+Constant *FSliceModulePass::getSiteVar(void) {
+  auto Site = dyn_cast<GlobalVariable>(
+      M->getOrInsertGlobal("__fslice_site", IntPtrTy));
+  Site->setThreadLocal(true);
+  return Site;
+}
+
+// Give every hook call in the function a site id, which is stored into
+// `__fslice_site` right before the call. A site is described by the hook, the
+// function, the index of the original basic block, and the source location.
+void FSliceModulePass::assignSites(void) {
+  if (!ProfileSites) return;
+  auto SiteVar = getSiteVar();
+  for (auto &HC : HookCalls) {
+    auto CI = HC.first;
+    std::string Loc = "?";
+    auto DLoc = CI->getDebugLoc();
+    if (!DLoc.isUnknown()) {
+      DIScope Scope(DLoc.getScope(*C));
+      Loc = (Scope.getFilename() + ":" + Twine(DLoc.getLine()) + ":" +
+             Twine(DLoc.getCol())).str();
+    }
+    auto Hook = CI->getCalledFunction()->getName().substr(9);  // `__fslice_`.
+    Sites.push_back((Hook + "\t" + F->getName() + "\t" + Twine(HC.second) +
+                     "\t" + Loc).str());
+    new StoreInst(ConstantInt::get(IntPtrTy, Sites.size(), false), SiteVar, CI);
+  }
+}
+
+// Create the table of site descriptions, along with a module constructor that
+// gives it to the runtime.
+void FSliceModulePass::registerSites(void) {
+  if (Sites.empty()) return;
+
+  auto Zero = ConstantInt::get(IntPtrTy, 0, false);
+  std::vector<Value *> Indices = {Zero, Zero};
+  std::vector<Constant *> Descs;
+  for (auto &Site : Sites) {
+    auto Str = ConstantDataArray::getString(*C, Site, true);
+    auto GStr = new GlobalVariable(*M, Str->getType(), true,
+                                   GlobalValue::PrivateLinkage, Str);
+    Descs.push_back(ConstantExpr::getGetElementPtr(GStr, Indices));
+  }
+  auto TableTy = ArrayType::get(VoidPtrTy, Descs.size());
+  auto Table = new GlobalVariable(
+      *M, TableTy, true, GlobalValue::PrivateLinkage,
+      ConstantArray::get(TableTy, Descs), "__fslice_sites");
+
+  auto Ctor = Function::Create(FunctionType::get(VoidTy, false),
+                               GlobalValue::InternalLinkage,
+                               "__fslice_init_sites", M);
+  auto B = BasicBlock::Create(*C, "", Ctor);
+  auto RegisterFunc = CreateFunc(VoidTy, "__fslice_register_sites", "",
+                                 PointerType::getUnqual(VoidPtrTy), IntPtrTy);
+  std::vector<Value *> args = {
+      ConstantExpr::getGetElementPtr(Table, Indices),
+      ConstantInt::get(IntPtrTy, Descs.size(), false)};
+  CallInst::Create(RegisterFunc, args, "", B);
+  ReturnInst::Create(*C, B);
+  appendToGlobalCtors(*M, Ctor, kRegisterPriority);
+  Sites.clear();
+}
+
 // Get a value that contains the tainted data for a local variable, or zero if
 // the variable isn't tainted.
 Value *FSliceModulePass::LoadTaint(Instruction *I, Value *V) {
@@ -332,6 +1455,13 @@ Value *FSliceModulePass::LoadTaint(Instruction *I, Value *V) {
   Instruction *RV = nullptr;
   if (auto TV = getTaint(V)) {
     RV = new LoadInst(TV);
+  } else if (!isa<Constant>(V) && !mayBeTainted(V)) {
+    return ConstantInt::get(TaintTy, 0, false);
+  } else if (auto CI = dyn_cast<ConstantInt>(V)) {
+    if (CI->isZero() || 64 < CI->getBitWidth()) {
+      return ConstantInt::get(TaintTy, 0, false);
+    }
+    RV = new LoadInst(getConstTaint(CI->getZExtValue()));
   } else {
     if (IntegerType *IT = dyn_cast<IntegerType>(V->getType())) {
       Instruction *CV = nullptr;
@@ -341,60 +1471,249 @@ Value *FSliceModulePass::LoadTaint(Instruction *I, Value *V) {
         CV = CastInst::Create(Instruction::ZExt, V, IntPtrTy);
       }
       IList.insert(I, CV);
-      auto ValueFunc = CreateFunc(IntPtrTy, "__fslice_value", "",
+      auto ValueFunc = CreateFunc(TaintTy, "__fslice_value", "",
                                   IntPtrTy);
-      RV = CallInst::Create(ValueFunc, {CV});
+      RV = CreateHook(ValueFunc, {CV});
     } else {
-      return ConstantInt::get(IntPtrTy, 0, false);
+      return ConstantInt::get(TaintTy, 0, false);
     }
   }
   IList.insert(I, RV);
   return RV;
 }
 
+// Get a pointer to the entry of the constant taint table that will hold the
+// taint of `Val`.
+Constant *FSliceModulePass::getConstTaint(uint64_t Val) {
+  if (!ConstTaints) {
+    ConstTaints = new GlobalVariable(
+        *M, ArrayType::get(TaintTy, 0), false, GlobalValue::ExternalLinkage,
+        nullptr, "__fslice_const_taints");
+  }
+  auto &Idx = ConstValToIdx[Val];
+  if (!Idx) {
+    ConstVals.push_back(Val);
+    Idx = ConstVals.size();
+  }
+  std::vector<Value *> Indices = {ConstantInt::get(IntPtrTy, 0, false),
+                                  ConstantInt::get(IntPtrTy, Idx - 1, false)};
+  return ConstantExpr::getGetElementPtr(ConstTaints, Indices);
+}
+
+// Create the constant taint table now that all constants are known, along with
+// a module constructor that asks the runtime to fill it in.
+void FSliceModulePass::registerConstTaints(void) {
+  if (!ConstTaints) return;
+
+  auto TableTy = ArrayType::get(TaintTy, ConstVals.size());
+  auto Taints = new GlobalVariable(
+      *M, TableTy, false, GlobalValue::PrivateLinkage,
+      ConstantAggregateZero::get(TableTy), "__fslice_const_taints");
+  auto Vals = new GlobalVariable(
+      *M, ArrayType::get(IntPtrTy, ConstVals.size()), true,
+      GlobalValue::PrivateLinkage,
+      ConstantDataArray::get(*C, ConstVals), "__fslice_const_vals");
+  ConstTaints->replaceAllUsesWith(
+      ConstantExpr::getBitCast(Taints, ConstTaints->getType()));
+  ConstTaints->eraseFromParent();
+  ConstTaints = nullptr;
+
+  auto Ctor = Function::Create(FunctionType::get(VoidTy, false),
+                               GlobalValue::InternalLinkage,
+                               "__fslice_init_const_taints", M);
+  auto B = BasicBlock::Create(*C, "", Ctor);
+  auto RegisterFunc = CreateFunc(VoidTy, "__fslice_register_values", "",
+                                 PointerType::getUnqual(IntPtrTy),
+                                 PointerType::getUnqual(TaintTy), IntPtrTy);
+  auto Zero = ConstantInt::get(IntPtrTy, 0, false);
+  std::vector<Value *> Indices = {Zero, Zero};
+  std::vector<Value *> args = {
+      ConstantExpr::getGetElementPtr(Vals, Indices),
+      ConstantExpr::getGetElementPtr(Taints, Indices),
+      ConstantInt::get(IntPtrTy, ConstVals.size(), false)};
+  CallInst::Create(RegisterFunc, args, "", B);
+  ReturnInst::Create(*C, B);
+
+  appendToGlobalCtors(*M, Ctor, kRegisterPriority);
+  ConstVals.clear();
+  ConstValToIdx.clear();
+}
+
 // Instrument a single instruction.
 void FSliceModulePass::runOnStore(BasicBlock *B, StoreInst *SI) {
   auto &IList = B->getInstList();
   auto V = SI->getValueOperand();
   auto P = SI->getPointerOperand();
+  if (countHook(mayPointToTaint(P))) return;
+  if (FieldOf.count(SI)) {
+    runOnField(SI, nullptr);
+    return;
+  }
+
   auto S = LoadStoreSize(DL, P);
   auto A = CastInst::CreatePointerCast(P, IntPtrTy);
 
   auto T = LoadTaint(SI, V);
   std::vector<Value *> args = {A, T};
   auto StoreFunc = CreateFunc(VoidTy, "__fslice_store", std::to_string(S),
-                              IntPtrTy, IntPtrTy);
+                              IntPtrTy, TaintTy);
   IList.insert(SI, A);
-  IList.insert(SI, CallInst::Create(StoreFunc, args));
+  if (InlineShadowChecks) {
+    // Storing a non-zero taint always goes through the runtime.
+    Instruction *Force = nullptr;
+    if (!isa<Constant>(T)) {
+      Force = new ICmpInst(ICmpInst::ICMP_NE, T,
+                           ConstantInt::get(TaintTy, 0, false));
+      IList.insert(SI, Force);
+    }
+    auto Slow = CheckShadow(SI, A, S, Force);
+    Slow->getInstList().insert(Slow->getTerminator(),
+                               CreateHook(StoreFunc, args));
+  } else {
+    IList.insert(SI, CreateHook(StoreFunc, args));
+  }
 }
 
+// Instrument a call. Tainted arguments are written into the argument slots.
+// Functions defined in this module clear the slots that they read, and the
+// slots passed to other functions (i.e. to the runtime, or through function
+// pointers) are cleared after the call. Calls to other external functions
+// don't pass taints at all.
 void FSliceModulePass::runOnCall(BasicBlock *B, CallInst *CI) {
   auto &IList = B->getInstList();
-  auto StoreFunc = CreateFunc(VoidTy, "__fslice_store_arg", "",
-                              IntPtrTy, IntPtrTy);
-  auto i = 0UL;
-  for (auto &A : CI->arg_operands()) {
-    std::vector<Value *> args = {ConstantInt::get(IntPtrTy, i++, false),
-                                 LoadTaint(CI, A.get())};
-    IList.insert(CI, CallInst::Create(StoreFunc, args));
+  auto Zero = ConstantInt::get(TaintTy, 0, false);
+  auto Callee = CI->getCalledFunction();
+  auto IsRuntime = Callee && Callee->getName().startswith("__fslice_");
+  auto IsDefined = Callee && !Callee->isDeclaration();
+  if (IsRuntime) HookCalls.push_back({CI, SiteB});
+
+  if (Callee && !IsDefined && !IsRuntime) {
+    if (CI->user_empty()) return;
+    if (auto RT = getTaint(CI)) IList.insertAfter(CI, new StoreInst(Zero, RT));
+    return;
   }
 
-  if (CI->user_empty()) return;
+  uint64_t NumArgs = CI->getNumArgOperands();
+  if (IsDefined) NumArgs = std::min<uint64_t>(NumArgs, Callee->arg_size());
+  NumArgs = std::min<uint64_t>(NumArgs, kNumArgTaints);
+  for (auto i = 0UL; i < NumArgs; ++i) {
+    auto A = CI->getArgOperand(i);
+    if (countHook(IsRuntime || mayBeTainted(A))) continue;
+    auto T = LoadTaint(CI, A);
+    if (isa<Constant>(T)) continue;  // Zero taint.
+    auto Slot = getArgTaint(i);
+    IList.insert(CI, new StoreInst(T, Slot));
+    if (!IsDefined) IList.insertAfter(CI, new StoreInst(Zero, Slot));
+  }
+
+  if (CI->user_empty() || skipHook(CI)) return;
 
   if (auto RT = getTaint(CI)) {
-    auto LoadFunc = CreateFunc(IntPtrTy, "__fslice_load_ret", "");
-    auto TR = CallInst::Create(LoadFunc);
+    auto Ret = getRetTaint();
+    auto TR = new LoadInst(Ret);
     IList.insertAfter(CI, new StoreInst(TR, RT));
     IList.insertAfter(CI, TR);
+
+    // The target of an indirect call might not set a return taint.
+    if (!Callee) IList.insert(CI, new StoreInst(Zero, Ret));
   }
 }
 
 void FSliceModulePass::runOnReturn(BasicBlock *B, ReturnInst *RI) {
-  if (auto RV = RI->getReturnValue()) {
-    auto &IList = B->getInstList();
-    auto StoreFunc = CreateFunc(VoidTy, "__fslice_store_ret", "",
-                                IntPtrTy);
-    IList.insert(RI, CallInst::Create(StoreFunc, {LoadTaint(RI, RV)}));
+  auto &IList = B->getInstList();
+  auto RV = RI->getReturnValue();
+  if (RV &&
+      !countHook(!PruneUntainted || findPNode(getRetPNode(F))->is_tainted)) {
+    IList.insert(RI, new StoreInst(LoadTaint(RI, RV), getRetTaint()));
+  }
+}
+
+// Returns true if the memory that `P` points to might be written, i.e. if `P`
+// is stored through, passed to a call, or escapes. Memory that is only ever
+// loaded from can't pick up a taint.
+static bool MayBeWritten(Value *P) {
+  std::vector<Value *> Work = {P};
+  std::set<Value *> Seen = {P};
+  while (!Work.empty()) {
+    auto V = Work.back();
+    Work.pop_back();
+    for (auto U : V->users()) {
+      if (isa<LoadInst>(U) || isa<ICmpInst>(U)) continue;
+      if (auto II = dyn_cast<IntrinsicInst>(U)) {
+        if (Intrinsic::lifetime_start == II->getIntrinsicID() ||
+            Intrinsic::lifetime_end == II->getIntrinsicID()) continue;
+      }
+      if (isa<GetElementPtrInst>(U) || isa<BitCastInst>(U) ||
+          isa<PHINode>(U) || isa<SelectInst>(U)) {
+        if (Seen.insert(U).second) Work.push_back(U);
+        continue;
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+// Find the fixed-size stack allocations whose shadow must be cleared when the
+// function returns, so that their stale taints don't leak into later frames
+// that reuse the same stack memory. Allocations that are never written, or
+// that can't hold a taint, are left alone. This runs before the function is
+// instrumented, as the hooks themselves use the allocations' addresses.
+void FSliceModulePass::collectClearedAllocas(void) {
+  for (auto &II : IIs) {
+    auto AI = dyn_cast<AllocaInst>(II.I);
+    if (!AI || II.B != &(F->getEntryBlock())) continue;
+    auto NumElems = dyn_cast<ConstantInt>(AI->getArraySize());
+    if (!NumElems || countHook(MayBeWritten(AI) && mayPointToTaint(AI))) {
+      continue;
+    }
+    ClearedAllocas.push_back(
+        {AI, DL->getTypeAllocSize(AI->getAllocatedType()) *
+             NumElems->getZExtValue()});
+  }
+}
+
+// Clear the shadow of the stack allocations found by `collectClearedAllocas`.
+// If the function has several returns then they are first merged into one
+// exit block, so that each allocation is cleared by a single hook call.
+void FSliceModulePass::clearAllocas(void) {
+  if (ClearedAllocas.empty()) return;
+  std::vector<std::pair<ReturnInst *,BasicBlock *>> Rets;
+  for (auto &II : IIs) {
+    if (auto RI = dyn_cast<ReturnInst>(II.I)) Rets.push_back({RI, II.B});
+  }
+  if (Rets.empty()) return;
+
+  auto RI = Rets[0].first;
+  SiteB = BlockIds[Rets[0].second];
+  if (1 < Rets.size()) {
+    auto Exit = BasicBlock::Create(*C, "fslice.exit", F);
+    PHINode *RV = nullptr;
+    if (!F->getReturnType()->isVoidTy()) {
+      RV = PHINode::Create(F->getReturnType(), Rets.size(), "", Exit);
+    }
+    auto ExitRI = ReturnInst::Create(*C, RV, Exit);
+    ExitRI->setDebugLoc(RI->getDebugLoc());
+    for (auto &Ret : Rets) {
+      if (RV) {
+        RV->addIncoming(Ret.first->getReturnValue(), Ret.first->getParent());
+      }
+      BranchInst::Create(Exit, Ret.first);
+      Ret.first->eraseFromParent();
+    }
+    RI = ExitRI;
+  }
+  SiteI = RI;
+
+  auto &IList = RI->getParent()->getInstList();
+  auto ClearFunc = CreateFunc(VoidTy, "__fslice_clear", "", IntPtrTy,
+                              IntPtrTy);
+  for (auto &Clear : ClearedAllocas) {
+    auto A = CastInst::CreatePointerCast(Clear.first, IntPtrTy);
+    std::vector<Value *> args = {
+        A, ConstantInt::get(IntPtrTy, Clear.second, false)};
+    IList.insert(RI, A);
+    IList.insert(RI, CreateHook(ClearFunc, args));
   }
 }
 
@@ -409,18 +1728,20 @@ void FSliceModulePass::runOnUnary(BasicBlock *B, UnaryInstruction *I) {
 }
 
 void FSliceModulePass::runOnBinary(BasicBlock *B, BinaryOperator *I) {
+  if (skipHook(I)) return;
   auto TD = getTaint(I);
   if (!TD) return;
 
   auto &IList = B->getInstList();
   auto LT = LoadTaint(I, I->getOperand(0));
   auto RT = LoadTaint(I, I->getOperand(1));
-  auto Op = CreateString(I->getOpcodeName());
-  auto Operator = CreateFunc(IntPtrTy, "__fslice_op2", "",
-                             Op->getType(), IntPtrTy, IntPtrTy);
+  auto Op = ConstantInt::get(
+      IntPtrTy, I->getOpcode() - Instruction::BinaryOpsBegin, false);
+  auto Operator = CreateFunc(TaintTy, "__fslice_op2", "",
+                             IntPtrTy, TaintTy, TaintTy);
 
   std::vector<Value *> args = {Op, LT, RT};
-  auto TV = CallInst::Create(Operator, args);
+  auto TV = CreateHook(Operator, args);
   IList.insert(I, TV);
   IList.insert(I, new StoreInst(TV, TD));
 }
@@ -438,6 +1759,7 @@ void FSliceModulePass::runOnIntrinsic(BasicBlock *B, MemIntrinsic *MI) {
   } else {
     return;
   }
+  if (countHook(mayPointToTaint(MI->getRawDest()))) return;
 
   auto &IList = B->getInstList();
   auto MemF = CreateFunc(VoidPtrTy, FName, "", IntPtrTy, IntPtrTy, IntPtrTy);
@@ -448,7 +1770,7 @@ void FSliceModulePass::runOnIntrinsic(BasicBlock *B, MemIntrinsic *MI) {
   IList.insert(MI, Src);
 
   std::vector<Value *> args = {MDest, Src, MI->getLength()};
-  IList.insert(MI, CallInst::Create(MemF, args));
+  IList.insert(MI, CreateHook(MemF, args));
 
   MI->eraseFromParent();
 }
@@ -1,98 +1,2015 @@
 /* Copyright 2015 Peter Goodman (peter@trailofbits.com), all rights reserved. */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <unordered_map>
 #include <iostream>
+#include <iterator>
+#include <memory>
 #include <fstream>
 #include <utility>
 #include <set>
 #include <vector>
 #include <cerrno>
+#include <mutex>
+#include <thread>
 
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "Trace.h"
+
+// A taint is two words, so that node ids don't wrap and offsets into objects
+// aren't limited to 2 GiB on long runs. The instrumentation passes it as an
+// `i128`, which the calling convention splits across the same two registers
+// as this struct.
 struct Taint {
-  uint64_t id:32;
-  uint64_t offset:31;
+  uint64_t id;
+  uint64_t offset:63;
   bool is_obj:1;
-} __attribute__((packed));
+};
+
+static_assert(sizeof(Taint) == 2 * sizeof(uint64_t),
+              "Taint must be two words.");
+
+struct SaveErrno {
+  int no;
+  SaveErrno(void)
+      : no(errno) {}
+  ~SaveErrno(void) {
+    errno = no;
+  }
+};
+
+// Try to merge things like binary operators, constants, and memory loads
+// into single taint nodes.
+#define CACHE 1
+
+// Treat heap-allocated memory objects as special intermediate objects.
+#define MEM false
+
+// Only create the shadow pages of a block read once they are first accessed.
+#define LAZY 1
+
+// Construct a global of the runtime before any constructor of the instrumented
+// module, no matter where the runtime is linked. The plugin's constructors
+// that register the module's tables run at the next priority.
+#define INIT_FIRST __attribute__((init_priority(101)))
+
+enum : uint64_t {
+  kPageShift = 12,
+  kPageSize = 1ULL << kPageShift,
+  kPageMask = kPageSize - 1,
+
+  // Number of shadow pages needed to cover a 47-bit user address space.
+  kNumPages = 1ULL << (47 - kPageShift),
+
+  // Number of objects allocated at once by a `SlabAllocator`.
+  kObjectsPerSlab = 64,
+
+  // Number of argument taint slots in `__fslice_args`.
+  kNumArgTaints = 16,
+
+  // Maximum number of runs that a shadow page can hold before it is
+  // materialized into one taint per byte.
+  kMaxRuns = 16,
+
+  // Amount of trace output that is buffered before being written out.
+  kTraceBufferSize = 1ULL << 20,
+
+  // Default size of each thread's trace ring buffer.
+  kTraceRingSize = 4ULL << 20,
+
+  // Number of taint ids that a thread takes from `gNextId` at once.
+  kIdsPerBatch = 1024,
+
+  // Number of independently locked shards in a `ShardedMap`.
+  kNumShards = 64,
+
+  // One in this many profiled hook calls is timed.
+  kSiteSamplePeriod = 64,
+
+  // Number of block reads whose shadow can be pending at once. Lazy
+  // directory entries hold the index of a block read in their low bits.
+  kLazySlotBits = 16,
+  kNumLazyBlocks = 1ULL << kLazySlotBits,
+
+  // Number of taints in each chunk of a `TaintArena`.
+  kTaintsPerChunk = 4096,
+
+  // Initial number of slots in each shard of an `OpMap`.
+  kOpSlotsPerShard = 256,
+
+  // Number of taint ids whose definitions are tracked by one chunk of the
+  // trace writer's `defined` bitmap.
+  kIdsPerChunk = 1ULL << 20,
+
+  // Maximum number of chunks of the `defined` bitmap that are kept. Ids below
+  // the kept chunks are old enough to be assumed defined.
+  kMaxDefinedChunks = 256,
+
+  // Number of milliseconds that a record can be held back while waiting for a
+  // record from another thread that defines one of its ids.
+  kMaxDeferredMillis = 20
+};
+
+// Minimal spin lock, used for short critical sections such as updating one
+// shadow page.
+class SpinLock {
+ public:
+  void lock(void) {
+    while (locked.exchange(true, std::memory_order_acquire)) {
+      while (locked.load(std::memory_order_relaxed)) {}
+    }
+  }
+
+  void unlock(void) {
+    locked.store(false, std::memory_order_release);
+  }
+
+  std::atomic<bool> locked;
+};
+
+// A run of bytes `[begin, end)` within a shadow page. The first byte of the
+// run has the taint `taint`, and if `is_seq` is true, then each subsequent
+// byte has an offset that is one greater than the previous byte's offset.
+struct ShadowRun {
+  uint16_t begin;
+  uint16_t end;
+  bool is_seq;
+  Taint taint;
+};
+
+// A run of bytes of memory, relative to some base address.
+struct MemoryRun {
+  uint64_t offset;
+  uint64_t size;
+  Taint taint;
+  bool is_seq;
+};
+
+// Shadow memory for one 4 KiB page of application memory. Pages start off
+// as a short sorted list of runs, where gaps between runs are untainted. If a
+// page gets too fragmented then it is materialized into one taint per byte.
+// Shadow pages are allocated on demand, so untouched application pages cost
+// nothing beyond their (lazily backed) directory entry.
+struct ShadowPage {
+  SpinLock lock;
+  Taint *bytes;
+  uint64_t num_runs;
+  ShadowRun runs[kMaxRuns];
+};
+
+// Materialized taints for every byte of a shadow page.
+struct ShadowBytes {
+  Taint bytes[kPageSize];
+};
+
+// Free-list allocator that carves fixed-size objects out of mmapped slabs
+// so that we don't need one system call per object. Objects are returned
+// uninitialized.
+template <typename T>
+class SlabAllocator {
+ public:
+  T *Alloc(void) {
+    std::lock_guard<SpinLock> locker(lock);
+    if (!free_list) {
+      auto slab = mmap(nullptr, kObjectsPerSlab * sizeof(T),
+                       PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (MAP_FAILED == slab) {
+        std::cerr << "Unable to allocate shadow memory." << std::endl;
+        abort();
+      }
+      auto objs = reinterpret_cast<T *>(slab);
+      for (auto i = 0U; i < kObjectsPerSlab; ++i) {
+        *reinterpret_cast<T **>(&(objs[i])) = free_list;
+        free_list = &(objs[i]);
+      }
+    }
+    auto obj = free_list;
+    free_list = *reinterpret_cast<T **>(obj);
+    return obj;
+  }
+
+  void Free(T *obj) {
+    std::lock_guard<SpinLock> locker(lock);
+    *reinterpret_cast<T **>(obj) = free_list;
+    free_list = obj;
+  }
+
+ private:
+  SpinLock lock;
+  T *free_list;
+};
+
+// Hash table that is split into independently locked shards, so that threads
+// interning different keys rarely contend on the same lock.
+template <typename K, typename V, typename H = std::hash<K>>
+class ShardedMap {
+ public:
+  // Returns the value associated with `key`. If there isn't one then `make()`
+  // creates it. `make` runs with the shard locked, so it runs at most once
+  // per key, and anything it does happens before other threads see the value.
+  template <typename F>
+  V FindOrInsert(const K &key, F make) {
+    auto &shard = shards[H()(key) % kNumShards];
+    std::lock_guard<std::mutex> locker(shard.lock);
+    auto it = shard.map.find(key);
+    if (it != shard.map.end()) return it->second;
+    const auto val = make();
+    shard.map.emplace(key, val);
+    return val;
+  }
+
+ private:
+  struct Shard {
+    std::mutex lock;
+    std::unordered_map<K, V, H> map;
+  };
+
+  Shard shards[kNumShards];
+};
+
+// Bump allocator for taint sequences that live until the program exits.
+class TaintArena {
+ public:
+  Taint *Copy(const Taint *taints, uint64_t size) {
+    if (size > avail) {
+      const auto chunk_size = std::max<uint64_t>(size, kTaintsPerChunk);
+      chunks.emplace_back(new Taint[chunk_size]);
+      next = chunks.back().get();
+      avail = chunk_size;
+    }
+    auto copy = next;
+    memcpy(copy, taints, size * sizeof(Taint));
+    next += size;
+    avail -= size;
+    return copy;
+  }
+
+ private:
+  std::vector<std::unique_ptr<Taint[]>> chunks;
+  Taint *next = nullptr;
+  uint64_t avail = 0;
+};
+
+// The byte taints of a loaded object.
+struct ObjectKey {
+  const Taint *taints;
+  uint64_t size;
+  uint64_t hash;
+
+  bool operator==(const ObjectKey &that) const {
+    return hash == that.hash && size == that.size &&
+           !memcmp(taints, that.taints, size * sizeof(Taint));
+  }
+};
+
+struct ObjectKeyHash {
+  size_t operator()(const ObjectKey &key) const {
+    return key.hash;
+  }
+};
+
+// Interns loaded objects by their exact byte taints, so that every load of
+// identically tainted memory shares one object node. The keys held by the
+// table are copied into a per-shard arena.
+class ObjectMap {
+ public:
+  template <typename F>
+  Taint FindOrInsert(const Taint *taints, uint64_t size, F make) {
+    const ObjectKey key = {taints, size, Hash(taints, size)};
+    auto &shard = shards[(key.hash >> 32) % kNumShards];
+    std::lock_guard<std::mutex> locker(shard.lock);
+    auto it = shard.map.find(key);
+    if (it != shard.map.end()) return it->second;
+    const auto val = make();
+    shard.map.emplace(ObjectKey{shard.arena.Copy(taints, size), size, key.hash},
+                      val);
+    return val;
+  }
+
+ private:
+  static uint64_t Hash(const Taint *taints, uint64_t size) {
+    auto hash = size;
+    for (auto i = 0UL; i < size; ++i) {
+      uint64_t bits[2] = {0, 0};
+      memcpy(bits, &(taints[i]), sizeof(Taint));
+      hash = (hash ^ bits[0]) * 0x9E3779B97F4A7C15ULL;
+      hash = (hash ^ bits[1]) * 0x9E3779B97F4A7C15ULL;
+      hash ^= hash >> 29;
+    }
+    return hash;
+  }
+
+  struct Shard {
+    std::mutex lock;
+    std::unordered_map<ObjectKey, Taint, ObjectKeyHash> map;
+    TaintArena arena;
+  };
+
+  Shard shards[kNumShards];
+};
+
+// Open-addressed hash table that interns binary operator nodes by their
+// opcode and operand taint ids. Slice nodes reuse it, keyed on their size,
+// origin id and origin offset. The table is split into independently locked
+// shards, and each shard grows when it becomes half full.
+class OpMap {
+ public:
+  template <typename F>
+  Taint FindOrInsert(uint64_t op, Taint t1, Taint t2, F make) {
+    const auto hash = Hash(op, t1.id, t2.id);
+    auto &shard = shards[(hash >> 32) % kNumShards];
+    std::lock_guard<std::mutex> locker(shard.lock);
+    if (2 * (shard.num_used + 1) > shard.slots.size()) Grow(shard);
+    auto &slot = Find(shard, hash, op, t1.id, t2.id);
+    if (slot.id) return {slot.id, 0, false};
+    const auto val = make();
+    slot = {op, t1.id, t2.id, val.id};
+    ++shard.num_used;
+    return val;
+  }
+
+ private:
+  // An empty slot has a zero `id`.
+  struct Slot {
+    uint64_t op;
+    uint64_t t1;
+    uint64_t t2;
+    uint64_t id;
+  };
+
+  struct Shard {
+    std::mutex lock;
+    std::vector<Slot> slots;
+    uint64_t num_used = 0;
+  };
+
+  static uint64_t Hash(uint64_t op, uint64_t t1, uint64_t t2) {
+    auto hash = (t1 ^ op) * 0x9E3779B97F4A7C15ULL;
+    hash = (hash ^ (hash >> 29) ^ t2) * 0x9E3779B97F4A7C15ULL;
+    return hash ^ (hash >> 29);
+  }
+
+  static Slot &Find(Shard &shard, uint64_t hash, uint64_t op, uint64_t t1,
+                    uint64_t t2) {
+    const auto mask = shard.slots.size() - 1;
+    for (auto i = hash & mask; ; i = (i + 1) & mask) {
+      auto &slot = shard.slots[i];
+      if (!slot.id || (slot.op == op && slot.t1 == t1 && slot.t2 == t2)) {
+        return slot;
+      }
+    }
+  }
+
+  static void Grow(Shard &shard) {
+    std::vector<Slot> old_slots(
+        std::max<uint64_t>(kOpSlotsPerShard, shard.slots.size() * 2));
+    old_slots.swap(shard.slots);
+    for (const auto &slot : old_slots) {
+      if (slot.id) {
+        Find(shard, Hash(slot.op, slot.t1, slot.t2),
+             slot.op, slot.t1, slot.t2) = slot;
+      }
+    }
+  }
+
+  Shard shards[kNumShards];
+};
+
+// Names of LLVM's binary operators, indexed by the opcode relative to
+// `Instruction::BinaryOpsBegin` that the plugin passes to `__fslice_op2`.
+static const char * const kBinaryOpNames[] = {
+  "add", "fadd", "sub", "fsub", "mul", "fmul", "udiv", "sdiv", "fdiv",
+  "urem", "srem", "frem", "shl", "lshr", "ashr", "and", "or", "xor"
+};
+
+static const uint64_t kNumBinaryOps =
+    sizeof kBinaryOpNames / sizeof kBinaryOpNames[0];
+
+// Names of the functions that the plugin summarizes. Calls to summary `i` are
+// traced as `A` records whose opcode is `kNumBinaryOps + i`. The names are
+// added to the trace's opcode names once the trace is initialized.
+static std::mutex gSummaryLock;
+static std::vector<std::string> gSummaryNames INIT_FIRST;
+static bool gSummaryNamesTraced = false;
+
+static std::mutex gShadowInit;
+
+extern "C" {
+
+// The shadow page directory. Instrumented code reads this directly to skip
+// calling into the runtime for untainted memory: if the directory is null, or
+// if `__fslice_shadow[(addr >> kPageShift) & (kNumPages - 1)]` is null, then
+// the page containing `addr` is untainted.
+std::atomic<ShadowPage **> __fslice_shadow(nullptr);
+
+// The taints of the arguments and return value of calls, which instrumented
+// code reads and writes directly. Argument slots are zero except while a call
+// is being made: the caller fills in the slots of its tainted arguments, and
+// the callee clears them on entry (or the caller clears them after calling
+// into the runtime).
+thread_local Taint __fslice_args[kNumArgTaints] = {{0,0}};
+thread_local Taint __fslice_ret = {0,0};
+
+// The id of the call site of the current hook, which instrumented code sets
+// before calling a hook if it was compiled with `-fslice-profile-sites`.
+thread_local uint64_t __fslice_site = 0;
+
+}  // extern "C"
+
+static SlabAllocator<ShadowPage> gPageAllocator;
+static SlabAllocator<ShadowBytes> gBytesAllocator;
+
+// Counters of hook calls and of shadow memory traffic.
+enum Stat : unsigned {
+  kStatLoad1,
+  kStatLoad2,
+  kStatLoad4,
+  kStatLoad8,
+  kStatLoad16,
+  kStatLoad32,
+  kStatLoad64,
+  kStatStore1,
+  kStatStore2,
+  kStatStore4,
+  kStatStore8,
+  kStatStore16,
+  kStatStore32,
+  kStatStore64,
+  kStatLoadFields,
+  kStatStoreFields,
+  kStatMemset,
+  kStatMemmove,
+  kStatMemcpy,
+  kStatStrcpy,
+  kStatBzero,
+  kStatMalloc,
+  kStatCalloc,
+  kStatRealloc,
+  kStatFree,
+  kStatClear,
+  kStatValue,
+  kStatRegisterValues,
+  kStatOp2,
+  kStatSummary,
+  kStatReadBlock,
+  kStatWriteBlock,
+  kStatName,
+  kStatData,
+  kNumHookStats,
+
+  kStatShadowBytesRead = kNumHookStats,
+  kStatShadowBytesWritten,
+  kStatShadowBytesScanned,
+  kStatShadowLazyPages,
+  kStatShadowResolvedLazyPages,
+  kNumStats
+};
+
+static const char * const kStatNames[] = {
+  "load1", "load2", "load4", "load8", "load16", "load32", "load64",
+  "store1", "store2", "store4", "store8", "store16", "store32", "store64",
+  "load_fields", "store_fields",
+  "memset", "memmove", "memcpy", "strcpy", "bzero", "malloc", "calloc",
+  "realloc", "free", "clear", "value", "register_values", "op2", "summary",
+  "read_block", "write_block", "name", "data",
+  "bytes_read", "bytes_written", "bytes_scanned", "lazy_pages",
+  "resolved_lazy_pages"
+};
+
+static_assert(kNumStats == sizeof kStatNames / sizeof kStatNames[0],
+              "Every statistic needs a name.");
+
+// The tables that intern nodes.
+enum Cache : unsigned {
+  kCacheObjects,
+  kCacheSlices,
+  kCacheValues,
+  kCacheBinaryOps,
+  kCacheBlocks,
+  kNumCaches
+};
+
+static const char * const kCacheNames[] = {
+  "objects", "slices", "values", "binary_ops", "blocks"
+};
+
+// Statistics counted by one thread. Only the owning thread writes its
+// counters, so they are updated without read-modify-write instructions, and
+// other threads only read them to dump the statistics. Thread statistics are
+// never freed, so that the counts of exited threads aren't lost.
+struct ThreadStats {
+  std::atomic<uint64_t> counts[kNumStats];
+  std::atomic<uint64_t> lookups[kNumCaches];
+  std::atomic<uint64_t> misses[kNumCaches];
+  std::atomic<uint64_t> records[256];  // Indexed by `TraceTag`.
+  ThreadStats *next;
+
+  // `kNumSiteCounters` counters for each hook call site, or null if the
+  // thread hasn't called any hooks while profiling.
+  std::atomic<std::atomic<uint64_t> *> sites;
+};
+
+static std::atomic<ThreadStats *> gAllStats(nullptr);
+static thread_local ThreadStats *gStats = nullptr;
+
+// Bytes of memory used by shadow pages and materialized shadow bytes, and
+// the most that they have ever used.
+static std::atomic<uint64_t> gShadowFootprint(0);
+static std::atomic<uint64_t> gPeakShadowFootprint(0);
+
+static ThreadStats &GetStats(void) {
+  if (!gStats) {
+    gStats = new ThreadStats();
+    gStats->next = gAllStats.load(std::memory_order_relaxed);
+    while (!gAllStats.compare_exchange_weak(gStats->next, gStats,
+                                            std::memory_order_release,
+                                            std::memory_order_relaxed)) {}
+  }
+  return *gStats;
+}
+
+static void Increment(std::atomic<uint64_t> &counter, uint64_t n) {
+  counter.store(counter.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+}
+
+static void Count(Stat stat, uint64_t n=1) {
+  Increment(GetStats().counts[stat], n);
+}
+
+static void CountLookup(Cache cache) {
+  Increment(GetStats().lookups[cache], 1);
+}
+
+static void CountMiss(Cache cache) {
+  Increment(GetStats().misses[cache], 1);
+}
+
+static void GrowShadowFootprint(uint64_t size) {
+  const auto footprint = gShadowFootprint.fetch_add(size) + size;
+  auto peak = gPeakShadowFootprint.load();
+  while (peak < footprint &&
+         !gPeakShadowFootprint.compare_exchange_weak(peak, footprint)) {}
+}
+
+static void ShrinkShadowFootprint(uint64_t size) {
+  gShadowFootprint.fetch_sub(size);
+}
+
+static Taint *AllocShadowBytes(void) {
+  GrowShadowFootprint(sizeof(ShadowBytes));
+  return gBytesAllocator.Alloc()->bytes;
+}
+
+static void FreeShadowBytes(Taint *bytes) {
+  ShrinkShadowFootprint(sizeof(ShadowBytes));
+  gBytesAllocator.Free(reinterpret_cast<ShadowBytes *>(bytes));
+}
+
+// Call sites of hooks, as registered by `__fslice_register_sites`. Site `i` is
+// described by `gSites[i - 1]`, and site zero stands for hook calls whose site
+// is unknown. Set once, before hooks are profiled.
+static const char * const *gSites = nullptr;
+static uint64_t gNumSites = 0;
+static const char *gProfilePath = nullptr;
+
+enum SiteCounter : unsigned {
+  kSiteCalls,
+  kSiteSamples,
+  kSiteCycles,
+  kNumSiteCounters
+};
+
+static thread_local bool gInHook = false;
+static thread_local uint64_t gSampleCountdown = 0;
+
+// Get the counters of the current thread for the hook call site `site`.
+static std::atomic<uint64_t> *GetSiteCounters(uint64_t site) {
+  auto &stats = GetStats();
+  auto sites = stats.sites.load(std::memory_order_relaxed);
+  if (!sites) {
+    sites = new std::atomic<uint64_t>[(gNumSites + 1) * kNumSiteCounters]();
+    stats.sites.store(sites, std::memory_order_release);
+  }
+  if (site > gNumSites) site = 0;
+  return &(sites[site * kNumSiteCounters]);
+}
+
+// Whether hooks trace anything. While tracing is off, hooks don't read the
+// shadow memory or create taints, and the memory that they write is untainted
+// so that stale taints don't outlive the data that they describe. Data that
+// is produced while tracing is off is therefore never tainted.
+static std::atomic<bool> gIsTracing(true);
+
+static bool IsTracing(void) {
+  return gIsTracing.load(std::memory_order_relaxed);
+}
+
+// Counts a call of a hook. While profiling, the call is also attributed to
+// its call site, and every `kSiteSamplePeriod`th call is timed. Hooks called
+// by other hooks aren't profiled, as the outer hook's time includes them.
+// Nothing is counted while tracing is off, so that the hooks' off path doesn't
+// touch the thread's statistics.
+class HookScope {
+ public:
+  explicit HookScope(Stat stat)
+      : counters(nullptr),
+        begin(0) {
+    if (!IsTracing()) return;
+    Count(stat);
+    if (!gProfilePath || gInHook) return;
+    gInHook = true;
+    counters = GetSiteCounters(__fslice_site);
+    Increment(counters[kSiteCalls], 1);
+    if (!gSampleCountdown--) {
+      gSampleCountdown = kSiteSamplePeriod - 1;
+      begin = __rdtsc();
+    }
+  }
+
+  ~HookScope(void) {
+    if (!counters) return;
+    gInHook = false;
+    if (begin) {
+      Increment(counters[kSiteSamples], 1);
+      Increment(counters[kSiteCycles], __rdtsc() - begin);
+    }
+  }
+
+ private:
+  HookScope(const HookScope &) = delete;
+  HookScope &operator=(const HookScope &) = delete;
+
+  std::atomic<uint64_t> *counters;
+  uint64_t begin;
+};
+
+// Single-producer, single-consumer ring buffer of encoded trace records.
+// Each thread that produces trace records owns one ring, and the trace writer
+// thread drains all rings. `head` and `tail` count the total number of bytes
+// ever written to and read from the ring, respectively. Rings are never freed;
+// the ring of an exited thread is adopted by the next new thread.
+struct TraceRing {
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;
+  std::atomic<bool> in_use;
+  uint64_t size;
+  uint8_t *data;
+  TraceRing *next;
+
+  // Records drained by the trace writer, but not yet written out, and since
+  // when the writer has been holding back the first of them. Only accessed
+  // while holding `gTrace->lock`.
+  std::vector<uint8_t> pending;
+  bool is_deferred;
+  std::chrono::steady_clock::time_point deferred_since;
+};
+
+// A record that the trace writer has drained from `ring`, and which is stored
+// in `ring->pending[begin, end)`.
+struct PendingRecord {
+  TraceRing *ring;
+  uint64_t begin;
+  uint64_t end;
+  bool is_written;
+  bool is_visiting;
+};
+
+// What a thread does when its trace ring is full.
+enum TracePolicy {
+  kTracePolicyBlock,  // Wait for the trace writer to make room.
+  kTracePolicyDrop  // Drop the record, and count it in `TraceState::num_drops`.
+};
+
+// Where trace records go. By default, traces are written as Python statements
+// to `stderr`. Setting `FSLICE_TRACE` redirects the trace to a file, and
+// setting `FSLICE_TRACE_FORMAT=binary` writes the compact binary format
+// described in `Trace.h`, which can be converted to Python statements with
+// `fslice-decode`.
+//
+// Hooks encode records into their thread's ring, and a background writer
+// thread drains the rings in large batches, so that formatting and I/O stay
+// off of the critical path. `FSLICE_TRACE_POLICY=drop` makes hooks drop
+// records instead of waiting when their ring is full, and
+// `FSLICE_TRACE_RING_SIZE` changes the size (in bytes) of each ring.
+//
+// Setting `FSLICE_STATS` to a path makes the runtime write its statistics
+// there as JSON when the program exits, and whenever it receives `SIGUSR1`.
+struct TraceState {
+  bool is_binary;
+  std::vector<std::string> op_names;
+  TracePolicy policy;
+  int fd;
+  uint64_t ring_size;
+  std::string stats_path;
+
+  std::atomic<TraceRing *> rings;
+  std::atomic<uint64_t> num_drops;
+  std::atomic<bool> is_stopped;
+
+  // Only accessed while holding `lock`.
+  std::mutex lock;
+  std::string buffer;
+  uint64_t num_bytes_written;
+  TraceRecord rec;
+  std::vector<PendingRecord> pending;
+  std::unordered_map<uint64_t, uint64_t> defs;
+
+  // Bitmap of the taint ids whose defining records have been written out,
+  // split into lazily allocated chunks of `kIdsPerChunk` bits. Only the most
+  // recent `kMaxDefinedChunks` chunks are kept, starting at `defined_base`.
+  std::deque<std::unique_ptr<uint64_t[]>> defined;
+  uint64_t defined_base;
+
+  std::thread writer;
+};
+
+// Owns a thread's trace ring, and releases it when the thread exits.
+struct TraceRingHandle {
+  TraceRing *ring;
+  ~TraceRingHandle(void) {
+    if (ring) ring->in_use.store(false, std::memory_order_release);
+  }
+};
+
+static TraceState *gTrace = nullptr;
+static std::once_flag gTraceInit;
+static thread_local TraceRingHandle gRing = {nullptr};
+static thread_local TraceRecord gRecord;
+static thread_local std::string gEncodedRecord;
+static thread_local std::vector<Taint> gLoadTaints;
+static thread_local std::vector<Taint> gSummaryInputs;
+
+static ShardedMap<uint64_t,Taint> gValues INIT_FIRST;
+static ObjectMap gObjects INIT_FIRST;
+static ShardedMap<uint64_t,Taint> gBlocks INIT_FIRST;
+static OpMap gBinaryOps INIT_FIRST;
+static OpMap gSlices INIT_FIRST;
+static std::atomic<uint64_t> gNextId(1);
+static thread_local uint64_t gId = 0;
+static thread_local uint64_t gLastId = 0;
+
+// Allocate a new taint id. Threads take ids from `gNextId` in batches so that
+// they don't all contend on one counter.
+static uint64_t NewId(void) {
+  if (gId == gLastId) {
+    gId = gNextId.fetch_add(kIdsPerBatch);
+    gLastId = gId + kIdsPerBatch;
+  }
+  return gId++;
+}
+
+extern "C" Taint __fslice_value(uint64_t);
+
+// Reserve (but don't back) the shadow page directory. The kernel only backs
+// the parts of the directory that are actually written to.
+static ShadowPage **AllocDirectory(void) {
+  auto dir = mmap(nullptr, kNumPages * sizeof(ShadowPage *),
+                  PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == dir) {
+    std::cerr << "Unable to reserve the shadow page directory." << std::endl;
+    abort();
+  }
+  return reinterpret_cast<ShadowPage **>(dir);
+}
+
+// Get the directory entry of the shadow page for `addr`.
+static ShadowPage **GetEntry(uint64_t addr) {
+  auto dir = __fslice_shadow.load(std::memory_order_acquire);
+  if (!dir) {
+    std::lock_guard<std::mutex> locker(gShadowInit);
+    dir = __fslice_shadow.load();
+    if (!dir) __fslice_shadow.store(dir = AllocDirectory());
+  }
+  return &(dir[(addr >> kPageShift) & (kNumPages - 1)]);
+}
+
+static ShadowPage *NewPage(void) {
+  auto page = gPageAllocator.Alloc();
+  page->lock.locked.store(false);
+  page->bytes = nullptr;
+  page->num_runs = 0;
+  return page;
+}
+
+// A block read whose shadow is written lazily. Rather than pointing to a shadow
+// page, the directory entries of the pages that the read covers (and that had
+// no shadow page yet) refer to the block read's slot and generation, with their
+// lowest bit set. The generation of a slot changes whenever the slot is reused
+// for another block read, and is odd while the slot is being updated, so that
+// stale entries can be told apart without taking the slot's lock.
+struct LazyBlock {
+  SpinLock lock;  // Held while reusing the slot.
+  std::atomic<uint64_t> generation;
+  std::atomic<uint64_t> addr;
+  std::atomic<uint64_t> size;
+  std::atomic<uint64_t> id;
+};
+
+static LazyBlock gLazyBlocks[kNumLazyBlocks];
+static std::atomic<uint64_t> gNextLazyBlock(0);
+
+static bool IsLazy(const ShadowPage *page) {
+  return reinterpret_cast<uintptr_t>(page) & 1;
+}
+
+static ShadowPage *LazyEntry(uint64_t slot, uint64_t generation) {
+  return reinterpret_cast<ShadowPage *>(
+      (generation << (kLazySlotBits + 1)) | (slot << 1) | 1);
+}
+
+// Read the block read that the lazy directory entry `entry` refers to. Returns
+// false if the block read's slot has been reused since `entry` was made.
+static bool ReadLazyBlock(ShadowPage *entry, MemoryRun &block) {
+  const auto slot = (reinterpret_cast<uintptr_t>(entry) >> 1) &
+                    (kNumLazyBlocks - 1);
+  auto &lazy = gLazyBlocks[slot];
+  const auto generation = lazy.generation.load(std::memory_order_acquire);
+  if (LazyEntry(slot, generation) != entry) return false;
+  block.offset = lazy.addr.load(std::memory_order_acquire);
+  block.size = lazy.size.load(std::memory_order_acquire);
+  block.taint = {lazy.id.load(std::memory_order_acquire), 0, false};
+  block.is_seq = true;
+  return generation == lazy.generation.load(std::memory_order_relaxed);
+}
+
+// Returns the run of the page at `page_addr` that a block read covers.
+static ShadowRun LazyRun(const MemoryRun &block, uint64_t page_addr) {
+  const auto begin = std::max(block.offset, page_addr);
+  const auto end = std::min(block.offset + block.size, page_addr + kPageSize);
+  return {static_cast<uint16_t>(begin - page_addr),
+          static_cast<uint16_t>(end - page_addr), true,
+          {block.taint.id, begin - block.offset, false}};
+}
+
+// Replace the lazy directory entry `*entry` of the page at `page_addr` with a
+// shadow page holding the run of the block read. Returns the new contents of
+// `*entry`, which might have been changed by another thread in the meantime.
+static ShadowPage *ResolveLazyPage(ShadowPage **entry, ShadowPage *lazy,
+                                   uint64_t page_addr) {
+  MemoryRun block;
+  if (!ReadLazyBlock(lazy, block)) {
+    return __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+  }
+  auto page = NewPage();
+  page->runs[0] = LazyRun(block, page_addr);
+  page->num_runs = 1;
+  if (__atomic_compare_exchange_n(entry, &lazy, page, false,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    GrowShadowFootprint(sizeof(ShadowPage));
+    Count(kStatShadowResolvedLazyPages);
+    return page;
+  }
+  gPageAllocator.Free(page);
+  return lazy;
+}
+
+// Get the shadow page for `addr`. If `alloc` is false then this returns
+// `nullptr` for pages that have never held a taint. Pages are installed into
+// the directory with a compare-and-swap, so lookups never need a lock. The
+// shadow page of a lazy block read is created here, on first access.
+static ShadowPage *GetPage(uint64_t addr, bool alloc) {
+  auto entry = GetEntry(addr);
+  auto page = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+  while (IsLazy(page)) page = ResolveLazyPage(entry, page, addr & ~kPageMask);
+  if (!page && alloc) {
+    auto new_page = NewPage();
+    if (__atomic_compare_exchange_n(entry, &page, new_page, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      GrowShadowFootprint(sizeof(ShadowPage));
+      page = new_page;
+    } else {
+      gPageAllocator.Free(new_page);
+      while (IsLazy(page)) {
+        page = ResolveLazyPage(entry, page, addr & ~kPageMask);
+      }
+    }
+  }
+  return page;
+}
+
+// Returns the taint of the byte at `offset` within a run.
+static Taint RunTaint(const ShadowRun &run, uint64_t offset) {
+  const auto delta = run.is_seq ? offset - run.begin : 0;
+  return {run.taint.id, run.taint.offset + delta, run.taint.is_obj};
+}
+
+// Returns true if `next` describes the bytes that immediately follow `run`.
+static bool RunContinues(const ShadowRun &run, const ShadowRun &next) {
+  if (run.end != next.begin || run.is_seq != next.is_seq) return false;
+  const auto t = RunTaint(run, next.begin);
+  return t.id == next.taint.id && t.offset == next.taint.offset &&
+         t.is_obj == next.taint.is_obj;
+}
+
+// Convert a page from a list of runs into one taint per byte.
+static void Materialize(ShadowPage *page) {
+  if (page->bytes) return;
+  auto bytes = AllocShadowBytes();
+  auto i = 0UL;
+  for (auto r = 0UL; r < page->num_runs; ++r) {
+    const auto &run = page->runs[r];
+    for (; i < run.begin; ++i) bytes[i] = {0, 0, false};
+    for (; i < run.end; ++i) bytes[i] = RunTaint(run, i);
+  }
+  for (; i < kPageSize; ++i) bytes[i] = {0, 0, false};
+  page->bytes = bytes;
+  page->num_runs = 0;
+}
+
+static bool SameTaint(Taint a, Taint b) {
+  return a.id == b.id && a.offset == b.offset && a.is_obj == b.is_obj;
+}
+
+// Turn a materialized page back into a list of runs if it is no longer too
+// fragmented, and free its bytes.
+static void Dematerialize(ShadowPage *page) {
+  ShadowRun runs[kMaxRuns];
+  auto n = 0UL;
+  const auto bytes = page->bytes;
+  for (auto i = 0UL; i < kPageSize; ) {
+    const auto t = bytes[i];
+    auto j = i + 1;
+    if (!t.id) {
+      while (j < kPageSize && !bytes[j].id) ++j;
+    } else {
+      if (kMaxRuns == n) return;
+      ShadowRun run = {static_cast<uint16_t>(i), 0, true, t};
+      run.is_seq = j == kPageSize || !SameTaint(bytes[j], t);
+      while (j < kPageSize && SameTaint(bytes[j], RunTaint(run, j))) ++j;
+      run.end = static_cast<uint16_t>(j);
+      runs[n++] = run;
+    }
+    i = j;
+  }
+  memcpy(page->runs, runs, n * sizeof(ShadowRun));
+  page->num_runs = n;
+  FreeShadowBytes(bytes);
+  page->bytes = nullptr;
+}
+
+// Set the taints of the bytes `[run.begin, run.end)` of `page`. A run with a
+// zero taint clears the bytes.
+static void WritePage(ShadowPage *page, ShadowRun run) {
+  if (page->bytes) {
+    if (0 == run.begin && kPageSize == run.end) {
+      FreeShadowBytes(page->bytes);
+      page->bytes = nullptr;
+    } else {
+      for (auto i = run.begin; i < run.end; ++i) {
+        page->bytes[i] = RunTaint(run, i);
+      }
+      return;
+    }
+  }
+
+  // Split any overlapping runs around the new run, and try to merge the new
+  // run with its neighbours.
+  ShadowRun runs[kMaxRuns * 2 + 1];
+  auto n = 0UL;
+  auto inserted = !run.taint.id;
+  for (auto r = 0UL; r < page->num_runs; ++r) {
+    auto old = page->runs[r];
+    if (old.begin < run.begin) {
+      auto left = old;
+      left.end = std::min(old.end, run.begin);
+      runs[n++] = left;
+    }
+    if (!inserted && old.begin >= run.begin) {
+      runs[n++] = run;
+      inserted = true;
+    }
+    if (old.end > run.end) {
+      auto right = old;
+      right.begin = std::max(old.begin, run.end);
+      right.taint = RunTaint(old, right.begin);
+      if (!inserted) {
+        runs[n++] = run;
+        inserted = true;
+      }
+      runs[n++] = right;
+    }
+  }
+  if (!inserted) runs[n++] = run;
+
+  auto num_runs = 0UL;
+  for (auto r = 0UL; r < n; ++r) {
+    if (num_runs && RunContinues(runs[num_runs - 1], runs[r])) {
+      runs[num_runs - 1].end = runs[r].end;
+    } else {
+      runs[num_runs++] = runs[r];
+    }
+  }
+
+  if (num_runs <= kMaxRuns) {
+    memcpy(page->runs, runs, num_runs * sizeof(ShadowRun));
+    page->num_runs = num_runs;
+  } else {
+    Materialize(page);
+    WritePage(page, run);
+  }
+}
+
+// Read the taints of the `size` bytes of memory starting at `addr` into
+// `taints`. Only the id and offset of each taint are kept. Each page's lock is
+// taken once.
+static void ReadShadow(uint64_t addr, uint64_t size, Taint *taints) {
+  Count(kStatShadowBytesRead, size);
+  while (size) {
+    const auto offset = addr & kPageMask;
+    const auto len = std::min(size, kPageSize - offset);
+    memset(taints, 0, len * sizeof(Taint));
+    if (auto page = GetPage(addr, false)) {
+      std::lock_guard<SpinLock> locker(page->lock);
+      if (page->bytes) {
+        for (auto i = 0UL; i < len; ++i) {
+          const auto mt = page->bytes[offset + i];
+          taints[i] = {mt.id, mt.offset, false};
+        }
+      } else {
+        const auto end = offset + len;
+        for (auto r = 0UL; r < page->num_runs; ++r) {
+          const auto &run = page->runs[r];
+          if (run.end <= offset) continue;
+          if (run.begin >= end) break;
+          const auto begin = std::max<uint64_t>(run.begin, offset);
+          const auto run_end = std::min<uint64_t>(run.end, end);
+          for (auto i = begin; i < run_end; ++i) {
+            const auto mt = RunTaint(run, i);
+            taints[i - offset] = {mt.id, mt.offset, false};
+          }
+        }
+      }
+    }
+    taints += len;
+    addr += len;
+    size -= len;
+  }
+}
+
+// Forget the lazy block read of the page containing `addr` if the bytes
+// `[begin, end)` of the page are about to be overwritten, and they include all
+// of the bytes that the block read covers.
+static void DropLazyPage(uint64_t addr, uint64_t begin, uint64_t end) {
+  auto entry = GetEntry(addr);
+  auto lazy = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+  MemoryRun block;
+  if (!IsLazy(lazy) || !ReadLazyBlock(lazy, block)) return;
+  const auto run = LazyRun(block, addr & ~kPageMask);
+  if (begin <= run.begin && run.end <= end) {
+    __atomic_compare_exchange_n(entry, &lazy, nullptr, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+  }
+}
+
+// Set the taints of `size` bytes of memory starting at `addr`. The first byte
+// gets the taint `t`. If `is_seq` is true then each subsequent byte's offset is
+// one greater than the previous byte's. Clearing the taint of an untouched
+// page doesn't allocate a shadow page.
+static void WriteShadow(uint64_t addr, uint64_t size, Taint t, bool is_seq) {
+  Count(kStatShadowBytesWritten, size);
+  while (size) {
+    const auto offset = addr & kPageMask;
+    const auto len = std::min(size, kPageSize - offset);
+    DropLazyPage(addr, offset, offset + len);
+    if (auto page = GetPage(addr, 0 != t.id)) {
+      std::lock_guard<SpinLock> locker(page->lock);
+      WritePage(page, {static_cast<uint16_t>(offset),
+                       static_cast<uint16_t>(offset + len), is_seq, t});
+    }
+    if (is_seq) t.offset += len;
+    addr += len;
+    size -= len;
+  }
+}
+
+// Clear the taints of `size` bytes of memory starting at `addr` because the
+// memory is dead. Unlike `WriteShadow`, this also frees the materialized bytes
+// of pages that are no longer too fragmented.
+static void ClearShadow(uint64_t addr, uint64_t size) {
+  while (size) {
+    const auto offset = addr & kPageMask;
+    const auto len = std::min(size, kPageSize - offset);
+    DropLazyPage(addr, offset, offset + len);
+    if (auto page = GetPage(addr, false)) {
+      std::lock_guard<SpinLock> locker(page->lock);
+      WritePage(page, {static_cast<uint16_t>(offset),
+                       static_cast<uint16_t>(offset + len), false,
+                       {0, 0, false}});
+      if (page->bytes) Dematerialize(page);
+    }
+    addr += len;
+    size -= len;
+  }
+}
+
+// Give the `size` bytes of memory starting at `addr` the consecutive bytes of
+// the block `t`, like `WriteShadow` does, but leave the pages that don't have
+// a shadow page yet to be resolved on first access. File systems often read a
+// whole block just to look at a few of its bytes.
+static void WriteLazyBlock(uint64_t addr, uint64_t size, Taint t) {
+  const auto slot = gNextLazyBlock.fetch_add(1) % kNumLazyBlocks;
+  auto &lazy = gLazyBlocks[slot];
+  std::lock_guard<SpinLock> locker(lazy.lock);
+
+  // Resolve the pages that still refer to the previous block read that used
+  // this slot.
+  const auto generation = lazy.generation.load(std::memory_order_relaxed);
+  const auto old_entry = LazyEntry(slot, generation);
+  const auto old_addr = lazy.addr.load(std::memory_order_relaxed);
+  const auto old_end = old_addr + lazy.size.load(std::memory_order_relaxed);
+  for (auto page_addr = old_addr & ~kPageMask; page_addr < old_end;
+       page_addr += kPageSize) {
+    auto entry = GetEntry(page_addr);
+    if (old_entry == __atomic_load_n(entry, __ATOMIC_ACQUIRE)) {
+      ResolveLazyPage(entry, old_entry, page_addr);
+    }
+  }
+
+  lazy.generation.store(generation + 1, std::memory_order_relaxed);
+  lazy.addr.store(addr, std::memory_order_release);
+  lazy.size.store(size, std::memory_order_release);
+  lazy.id.store(t.id, std::memory_order_release);
+  lazy.generation.store(generation + 2, std::memory_order_release);
+
+  const auto new_entry = LazyEntry(slot, generation + 2);
+  for (auto i = 0UL; i < size; ) {
+    const auto offset = (addr + i) & kPageMask;
+    const auto len = std::min(size - i, kPageSize - offset);
+    auto entry = GetEntry(addr + i);
+    auto page = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+
+    // Pages without shadow pages, and the pages of other lazy block reads that
+    // are completely overwritten, refer to this block read. Other pages are
+    // written now.
+    if ((!page || (IsLazy(page) && kPageSize == len)) &&
+        __atomic_compare_exchange_n(entry, &page, new_entry, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      Count(kStatShadowLazyPages);
+    } else {
+      WriteShadow(addr + i, len, {t.id, i, false}, true);
+    }
+    i += len;
+  }
+}
+
+// Collect maximal runs of the bytes `[i, end)` of `page` into `runs`, where
+// `i` and `end` are offsets into the page. At most `kMaxRuns + 1` runs are
+// collected, and `i` is advanced past the collected runs. Runs are relative
+// to the start of the page. Untainted bytes are reported as runs with a zero
+// taint.
+static uint64_t CollectRuns(ShadowPage *page, uint64_t &i, uint64_t end,
+                            MemoryRun *runs) {
+  std::lock_guard<SpinLock> locker(page->lock);
+  auto n = 0UL;
+  if (page->bytes) {
+    while (i < end && n <= kMaxRuns) {
+      const auto t = page->bytes[i];
+      auto j = i + 1;
+      if (t.id) {
+        for (; j < end; ++j) {
+          const auto b = page->bytes[j];
+          if (b.id != t.id || b.is_obj != t.is_obj ||
+              b.offset != t.offset + (j - i)) break;
+        }
+      } else {
+        while (j < end && !page->bytes[j].id) ++j;
+      }
+      runs[n++] = {i, j - i, t, 0 != t.id};
+      i = j;
+    }
+    return n;
+  }
+
+  for (auto r = 0UL; r < page->num_runs && i < end; ++r) {
+    const auto &run = page->runs[r];
+    if (run.end <= i) continue;
+    const auto begin = std::max<uint64_t>(run.begin, i);
+    if (begin >= end) break;
+    if (i < begin) runs[n++] = {i, begin - i, {0, 0, false}, false};
+    i = std::min<uint64_t>(run.end, end);
+    runs[n++] = {begin, i - begin, RunTaint(run, begin), run.is_seq};
+  }
+  if (i < end) {
+    runs[n++] = {i, end - i, {0, 0, false}, false};
+    i = end;
+  }
+  return n;
+}
+
+// Returns true if `next` continues `run`, where `next` immediately follows
+// `run` in memory.
+static bool ContinuesRun(const MemoryRun &run, const MemoryRun &next) {
+  if (run.taint.id != next.taint.id) return false;
+  if (!run.taint.id) return true;
+  if (run.taint.is_obj != next.taint.is_obj) return false;
+  if (run.is_seq) {
+    return next.is_seq && next.taint.offset == run.taint.offset + run.size;
+  }
+  return !next.is_seq && next.taint.offset == run.taint.offset;
+}
+
+// Invoke `cb(addr, size, taint, is_seq)` on maximal runs of the bytes in
+// `[addr, addr + size)`. Untainted bytes are reported as runs with a zero
+// taint. Runs are merged across page boundaries, so `cb` is only invoked once
+// the following run has been collected. `cb` is invoked without holding any
+// page locks, so it can modify the shadow memory of the run it is given.
+template <typename CB>
+static void ForEachRun(uint64_t addr, uint64_t size, CB cb) {
+  Count(kStatShadowBytesScanned, size);
+  MemoryRun runs[kMaxRuns * 2 + 2];
+  MemoryRun prev = {0, 0, {0, 0, false}, false};
+  auto add = [&] (const MemoryRun &run) {
+    if (prev.size && ContinuesRun(prev, run)) {
+      prev.size += run.size;
+      return;
+    }
+    if (prev.size) cb(prev.offset, prev.size, prev.taint, prev.is_seq);
+    prev = run;
+  };
+  while (size) {
+    const auto offset = addr & kPageMask;
+    const auto len = std::min(size, kPageSize - offset);
+    const auto base = addr - offset;
+    if (auto page = GetPage(addr, false)) {
+      for (auto i = offset, end = offset + len; i < end; ) {
+        const auto n = CollectRuns(page, i, end, runs);
+        for (auto r = 0UL; r < n; ++r) {
+          add({base + runs[r].offset, runs[r].size, runs[r].taint,
+               runs[r].is_seq});
+        }
+      }
+    } else {
+      add({addr, len, {0, 0, false}, false});
+    }
+    addr += len;
+    size -= len;
+  }
+  if (prev.size) cb(prev.offset, prev.size, prev.taint, prev.is_seq);
+}
+
+// Write out any buffered trace output. The caller must hold `gTrace->lock`.
+static void FlushTrace(void) {
+  auto data = gTrace->buffer.data();
+  auto size = gTrace->buffer.size();
+  while (size) {
+    const auto ret = write(gTrace->fd, data, size);
+    if (0 < ret) {
+      data += ret;
+      size -= static_cast<uint64_t>(ret);
+      gTrace->num_bytes_written += static_cast<uint64_t>(ret);
+    } else if (0 > ret && EINTR != errno) {
+      break;
+    }
+  }
+  gTrace->buffer.clear();
+}
 
-struct SaveErrno {
-  int no;
-  SaveErrno(void)
-      : no(errno) {}
-  ~SaveErrno(void) {
-    errno = no;
+// Returns true if a record defining the taint id `id` has been written out.
+// The caller must hold `gTrace->lock`.
+static bool IsDefined(uint64_t id) {
+  const auto chunk = id / kIdsPerChunk;
+  const auto bit = id % kIdsPerChunk;
+  if (!id || chunk < gTrace->defined_base) return true;
+  const auto index = chunk - gTrace->defined_base;
+  if (index >= gTrace->defined.size() || !gTrace->defined[index]) return false;
+  return 0 != (gTrace->defined[index][bit / 64] & (1ULL << (bit % 64)));
+}
+
+// Remember that a record defining the taint id `id` has been written out.
+// The caller must hold `gTrace->lock`.
+static void SetDefined(uint64_t id) {
+  const auto chunk = id / kIdsPerChunk;
+  const auto bit = id % kIdsPerChunk;
+  auto &defined = gTrace->defined;
+  if (chunk < gTrace->defined_base) return;
+
+  // Slide the window of kept chunks forward, forgetting the oldest ones.
+  if (chunk - gTrace->defined_base >= kMaxDefinedChunks) {
+    const auto base = chunk + 1 - kMaxDefinedChunks;
+    const auto num_dropped = std::min<uint64_t>(base - gTrace->defined_base,
+                                                defined.size());
+    defined.erase(defined.begin(), defined.begin() + num_dropped);
+    gTrace->defined_base = base;
   }
-};
+  const auto index = chunk - gTrace->defined_base;
+  if (index >= defined.size()) defined.resize(index + 1);
+  auto &bits = defined[index];
+  if (!bits) {
+    bits.reset(new uint64_t[kIdsPerChunk / 64]);
+    memset(bits.get(), 0, kIdsPerChunk / 8);
+  }
+  bits[bit / 64] |= 1ULL << (bit % 64);
+}
 
-// Try to merge things like binary operators, constants, and memory loads
-// into single taint nodes.
-#define CACHE 1
+// Move all complete records out of `ring` and into the ring's pending bytes.
+// Returns `true` if anything was moved. The caller must hold `gTrace->lock`.
+static bool CopyRing(TraceRing *ring) {
+  const auto tail = ring->tail.load(std::memory_order_relaxed);
+  const auto head = ring->head.load(std::memory_order_acquire);
+  if (head == tail) return false;
 
-// Treat heap-allocated memory objects as special intermediate objects.
-#define MEM false
+  const auto size = head - tail;
+  const auto pos = tail & (ring->size - 1);
+  const auto first = std::min(size, ring->size - pos);
+  auto &pending = ring->pending;
+  const auto old_size = pending.size();
+  pending.resize(old_size + size);
+  memcpy(&(pending[old_size]), &(ring->data[pos]), first);
+  memcpy(&(pending[old_size + first]), ring->data, size - first);
+  ring->tail.store(head, std::memory_order_release);
+  return true;
+}
 
-static Taint gArgs[16] = {{0,0}};
-static Taint gReturn = {0,0};
-static std::unordered_map<uint64_t,Taint> gShadow;
-static std::unordered_map<uint64_t,Taint> gValues;
-static std::unordered_map<uint64_t,Taint> gObjects;
-static std::set<uint64_t> gPrintedBlocks;
-static std::unordered_map<uint64_t,Taint> gBlocks;
-static std::unordered_map<uint64_t,uint64_t> gPrevBlock;
-static std::unordered_map<const char *,std::unordered_map<uint64_t,Taint>> gBinaryOps;
-static unsigned gId = 1;
+// Write out a pending record, after first writing out any pending records
+// from other threads that define the ids that it references. Returns false
+// if the record references an id whose definition hasn't been drained yet,
+// unless `force` is true. The caller must hold `gTrace->lock`.
+static bool WriteRecord(uint64_t index, bool force) {
+  auto &pr = gTrace->pending[index];
+  if (pr.is_written) return true;
+  if (pr.is_visiting) return force;
 
-extern "C" Taint __fslice_value(uint64_t);
+  const uint8_t *begin = &(pr.ring->pending[pr.begin]);
+  const uint8_t *end = &(pr.ring->pending[pr.end]);
+  auto p = begin;
+  auto &rec = gTrace->rec;
+  DecodeRecord(p, end, rec);
 
-// Load a taint from the shadow memory.
-static Taint Load(uint64_t addr, uint64_t size) {
-  SaveErrno save_errno;
-#if CACHE
-  // So this isn't super great, but it's sufficient for now. Hopefully there
-  // are no collisions!
-  uint64_t obj_hash = 0;
-  for (auto i = 0U; i < size; ++i) {
-    const auto mt = gShadow[addr + i];
-    obj_hash = ((obj_hash ^ mt.id) << 27) | ((obj_hash >> 19) ^ mt.offset);
+  auto num_missing = 0UL;
+  if (!force) {
+    for (const auto &ref : rec.refs) {
+      if (!IsDefined(ref.id)) ++num_missing;
+    }
+  }
+  if (num_missing) {
+    std::vector<uint64_t> missing;
+    for (const auto &ref : rec.refs) {
+      if (!IsDefined(ref.id)) missing.push_back(ref.id);
+    }
+    pr.is_visiting = true;
+    for (auto id : missing) {
+      auto def = gTrace->defs.find(id);
+      if (def == gTrace->defs.end() || !WriteRecord(def->second, false)) {
+        gTrace->pending[index].is_visiting = false;
+        return false;
+      }
+    }
+    gTrace->pending[index].is_visiting = false;
+    p = begin;
+    DecodeRecord(p, end, rec);
   }
 
-  auto &t = gObjects[obj_hash];
-  if (t.id) return t;
-  t = {gId++, 0, false};
-#else
-  Taint t = {gId++, 0, false};
-#endif
+  if (gTrace->is_binary) {
+    gTrace->buffer.append(reinterpret_cast<const char *>(begin), end - begin);
+  } else {
+    FormatRecord(rec, gTrace->op_names, gTrace->buffer);
+  }
+  if (kTraceAssign != rec.tag) SetDefined(rec.id);
+  gTrace->pending[index].is_written = true;
+  return true;
+}
+
+// Drain every thread's trace ring and write out the drained records. Returns
+// `true` if any record was drained or written out, i.e. if progress was made.
+// The caller must hold `gTrace->lock`.
+//
+// Records from different threads can be drained in the wrong order: a thread
+// might reference an id that another thread defined, but whose definition is
+// still in the other thread's ring, or later in this batch. Such records are
+// held back until the definition is written out, but for no more than
+// `kMaxDeferredMillis`, or at all if `force` is true.
+static bool DrainRings(bool force) {
+  auto drained = false;
+  auto num_pending = 0UL;
+  for (auto ring = gTrace->rings.load(std::memory_order_acquire);
+       ring; ring = ring->next) {
+    drained = CopyRing(ring) || drained;
+    if (!ring->pending.empty()) ++num_pending;
+  }
+  if (!num_pending) return drained;
+
+  // Split the pending bytes into records, and index the records by the ids
+  // that they define. There is nothing to pull in from other rings if only one
+  // ring has pending records.
+  auto &pending = gTrace->pending;
+  auto &rec = gTrace->rec;
+  pending.clear();
+  gTrace->defs.clear();
+  for (auto ring = gTrace->rings.load(std::memory_order_acquire);
+       ring; ring = ring->next) {
+    const uint8_t *begin = ring->pending.data();
+    const auto end = begin + ring->pending.size();
+    for (auto p = begin; p < end; ) {
+      const auto offset = static_cast<uint64_t>(p - begin);
+      if (!DecodeRecord(p, end, rec)) break;
+      if (1 < num_pending && kTraceAssign != rec.tag) {
+        gTrace->defs[rec.id] = pending.size();
+      }
+      pending.push_back({ring, offset, static_cast<uint64_t>(p - begin),
+                         false, false});
+    }
+  }
+
+  // Write out each ring's records in order, pulling in definitions from other
+  // rings as needed. A ring stops at its first record that can't be written.
+  const auto now = std::chrono::steady_clock::now();
+  const auto max_wait = std::chrono::milliseconds(kMaxDeferredMillis);
+  for (auto i = 0UL; i < pending.size(); ) {
+    const auto ring = pending[i].ring;
+    const auto ring_force = force || (ring->is_deferred &&
+                                      now - ring->deferred_since >= max_wait);
+    auto is_blocked = false;
+    for (; i < pending.size() && pending[i].ring == ring; ++i) {
+      if (!is_blocked && !WriteRecord(i, ring_force)) is_blocked = true;
+    }
+    if (!is_blocked) {
+      ring->is_deferred = false;
+    } else if (!ring->is_deferred) {
+      ring->is_deferred = true;
+      ring->deferred_since = now;
+    }
+  }
+
+  // Keep the records that weren't written out.
+  auto wrote = false;
+  std::vector<uint8_t> kept;
+  for (auto i = 0UL; i < pending.size(); ) {
+    const auto ring = pending[i].ring;
+    kept.clear();
+    for (; i < pending.size() && pending[i].ring == ring; ++i) {
+      if (pending[i].is_written) {
+        wrote = true;
+        continue;
+      }
+      kept.insert(kept.end(), &(ring->pending[pending[i].begin]),
+                  &(ring->pending[0]) + pending[i].end);
+    }
+    ring->pending.swap(kept);
+  }
+  if (gTrace->buffer.size() >= kTraceBufferSize) FlushTrace();
+  return drained || wrote;
+}
+
+// Write `contents` to the file at `path`, replacing the file.
+static void WriteFile(const char *path, const std::string &contents) {
+  const auto fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (0 > fd) return;
+  auto data = contents.data();
+  auto size = contents.size();
+  while (size) {
+    const auto ret = write(fd, data, size);
+    if (0 < ret) {
+      data += ret;
+      size -= static_cast<uint64_t>(ret);
+    } else if (0 > ret && EINTR != errno) {
+      break;
+    }
+  }
+  close(fd);
+}
+
+// Write the statistics as JSON to `gTrace->stats_path`. This is called with
+// `gTrace->lock` held.
+static void DumpStats(void) {
+  uint64_t counts[kNumStats] = {0};
+  uint64_t lookups[kNumCaches] = {0};
+  uint64_t misses[kNumCaches] = {0};
+  uint64_t records[256] = {0};
+  for (auto stats = gAllStats.load(std::memory_order_acquire);
+       stats; stats = stats->next) {
+    for (auto i = 0U; i < kNumStats; ++i) {
+      counts[i] += stats->counts[i].load(std::memory_order_relaxed);
+    }
+    for (auto i = 0U; i < kNumCaches; ++i) {
+      lookups[i] += stats->lookups[i].load(std::memory_order_relaxed);
+      misses[i] += stats->misses[i].load(std::memory_order_relaxed);
+    }
+    for (auto i = 0U; i < 256; ++i) {
+      records[i] += stats->records[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  std::string json;
   auto sep = "";
-  std::cerr << "t" << t.id << "=O(";
-  for (auto i = 0U; i < size; ++i) {
-    const auto mt = gShadow[addr + i];
-    std::cerr << sep << "t" << mt.id << "[" << mt.offset << "]";
-    sep = ",";
+  auto field = [&] (const char *name, uint64_t val) {
+    json.append(sep).append("\"").append(name).append("\": ");
+    json.append(std::to_string(val));
+    sep = ", ";
+  };
+  auto begin = [&] (const char *name) {
+    json.append(sep).append("\"").append(name).append("\": {");
+    sep = "";
+  };
+  auto end = [&] (void) {
+    json.append("}");
+    sep = ",\n  ";
+  };
+
+  json.append("{\n  ");
+  begin("hooks");
+  for (auto i = 0U; i < kNumHookStats; ++i) field(kStatNames[i], counts[i]);
+  end();
+
+  begin("shadow");
+  for (unsigned i = kNumHookStats; i < kNumStats; ++i) {
+    field(kStatNames[i], counts[i]);
+  }
+  field("footprint", gShadowFootprint.load());
+  field("peak_footprint", gPeakShadowFootprint.load());
+  end();
+
+  begin("nodes");
+  for (auto tag : {kTraceValue, kTraceOp, kTraceObject, kTraceSlice,
+                   kTraceBlock, kTraceName, kTraceData, kTraceMalloc}) {
+    const char name[] = {static_cast<char>(tag), '\0'};
+    field(name, records[tag]);
+  }
+  end();
+
+  begin("caches");
+  for (auto i = 0U; i < kNumCaches; ++i) {
+    begin(kCacheNames[i]);
+    field("lookups", lookups[i]);
+    field("hits", lookups[i] - misses[i]);
+    field("misses", misses[i]);
+    char rate[32];
+    snprintf(rate, sizeof rate, "%.4f",
+             lookups[i] ? double(lookups[i] - misses[i]) / lookups[i] : 0.0);
+    json.append(", \"hit_rate\": ").append(rate).append("}");
+    sep = ", ";
+  }
+  end();
+
+  begin("trace");
+  field("assign_records", records[kTraceAssign]);
+  field("bytes_written", gTrace->num_bytes_written);
+  field("drops", gTrace->num_drops.load());
+  end();
+  json.append("\n}\n");
+  WriteFile(gTrace->stats_path.c_str(), json);
+}
+
+// Write the hook call site profile to `gProfilePath`. Each line has a site id,
+// the number of calls made from the site, how many of those were timed, the
+// total cycles of the timed calls, and then the hook, function, basic block
+// and source location of the site, all separated by tabs.
+static void DumpProfile(void) {
+  if (!gProfilePath) return;
+  std::vector<uint64_t> counts((gNumSites + 1) * kNumSiteCounters, 0);
+  for (auto stats = gAllStats.load(std::memory_order_acquire);
+       stats; stats = stats->next) {
+    auto sites = stats->sites.load(std::memory_order_acquire);
+    if (!sites) continue;
+    for (auto i = 0UL; i < counts.size(); ++i) {
+      counts[i] += sites[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  std::string profile;
+  for (auto site = 0UL; site <= gNumSites; ++site) {
+    const auto site_counts = &(counts[site * kNumSiteCounters]);
+    if (!site_counts[kSiteCalls]) continue;
+    profile.append(std::to_string(site));
+    for (auto i = 0U; i < kNumSiteCounters; ++i) {
+      profile.append("\t").append(std::to_string(site_counts[i]));
+    }
+    profile.append("\t");
+    profile.append(site ? gSites[site - 1] : "?\t?\t?\t?");
+    profile.append("\n");
+  }
+  WriteFile(gProfilePath, profile);
+}
+
+// Set by `SIGUSR1` to ask the trace writer to dump the statistics.
+static std::atomic<bool> gDumpStats(false);
+
+static void DumpStatsOnSignal(int) {
+  gDumpStats.store(true);
+}
+
+// Main loop of the trace writer thread.
+static void WriteTrace(void) {
+  while (!gTrace->is_stopped.load(std::memory_order_acquire)) {
+    std::unique_lock<std::mutex> locker(gTrace->lock);
+    if (gDumpStats.exchange(false)) DumpStats();
+    if (!DrainRings(false)) {
+      FlushTrace();
+      locker.unlock();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+}
+
+// Stop the trace writer thread, and write out everything that is left in the
+// trace rings. After this, hooks drain the rings themselves.
+static void StopTrace(void) {
+  if (gTrace->is_stopped.exchange(true)) return;
+  if (gTrace->writer.joinable()) {
+    if (gTrace->writer.get_id() == std::this_thread::get_id()) {
+      gTrace->writer.detach();
+    } else {
+      gTrace->writer.join();
+    }
+  }
+  std::lock_guard<std::mutex> locker(gTrace->lock);
+  DrainRings(true);
+  FlushTrace();
+  if (!gTrace->stats_path.empty()) DumpStats();
+  if (auto num_drops = gTrace->num_drops.load()) {
+    std::cerr << "FSlice dropped " << num_drops << " trace records."
+              << std::endl;
+  }
+}
+
+static const int kFatalSignals[] = {
+    SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGINT, SIGSEGV, SIGTERM};
+static struct sigaction gOldSigActions[sizeof kFatalSignals / sizeof(int)];
+
+// Save the trace when the program is killed by a fatal signal, then defer to
+// whatever would have handled the signal before us. This is best-effort: the
+// writer isn't async-signal-safe, but the alternative is losing the trace.
+static void StopTraceOnSignal(int sig) {
+  StopTrace();
+  DumpProfile();
+  for (auto i = 0U; i < sizeof kFatalSignals / sizeof(int); ++i) {
+    if (kFatalSignals[i] == sig) sigaction(sig, &(gOldSigActions[i]), nullptr);
+  }
+  raise(sig);
+}
+
+// Figure out where the trace should go, and start the trace writer thread.
+static void InitTrace(void) {
+  gTrace = new TraceState;
+  gTrace->is_binary = false;
+  gTrace->policy = kTracePolicyBlock;
+  gTrace->fd = 2;
+  gTrace->ring_size = kTraceRingSize;
+  gTrace->num_bytes_written = 0;
+  gTrace->defined_base = 0;
+  gTrace->rings.store(nullptr);
+  gTrace->num_drops.store(0);
+  gTrace->is_stopped.store(false);
+
+  if (auto format = getenv("FSLICE_TRACE_FORMAT")) {
+    gTrace->is_binary = !strcmp(format, "binary");
+  }
+  if (auto policy = getenv("FSLICE_TRACE_POLICY")) {
+    if (!strcmp(policy, "drop")) gTrace->policy = kTracePolicyDrop;
+  }
+  if (auto ring_size = getenv("FSLICE_TRACE_RING_SIZE")) {
+    const auto min_size = strtoull(ring_size, nullptr, 0);
+    gTrace->ring_size = kPageSize;
+    while (gTrace->ring_size < min_size) gTrace->ring_size *= 2;
+  }
+  if (auto path = getenv("FSLICE_TRACE")) {
+    gTrace->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (0 > gTrace->fd) {
+      std::cerr << "Unable to open trace file " << path << std::endl;
+      abort();
+    }
+  }
+  if (auto path = getenv("FSLICE_STATS")) {
+    gTrace->stats_path = path;
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = DumpStatsOnSignal;
+    sigemptyset(&(action.sa_mask));
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &action, nullptr);
+  }
+  {
+    std::lock_guard<std::mutex> locker(gSummaryLock);
+    gTrace->op_names.assign(std::begin(kBinaryOpNames),
+                            std::end(kBinaryOpNames));
+    gTrace->op_names.insert(gTrace->op_names.end(), gSummaryNames.begin(),
+                            gSummaryNames.end());
+    gSummaryNamesTraced = true;
+  }
+  gTrace->buffer.reserve(kTraceBufferSize + gTrace->ring_size);
+  if (gTrace->is_binary) {
+    gTrace->buffer.append(kTraceMagic, kTraceMagicSize);
+    auto &rec = gTrace->rec;
+    rec.Clear(kTraceOpNames, 0);
+    rec.names = gTrace->op_names;
+    EncodeRecord(rec, gTrace->buffer);
+  }
+
+  atexit(StopTrace);
+  for (auto i = 0U; i < sizeof kFatalSignals / sizeof(int); ++i) {
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = StopTraceOnSignal;
+    sigemptyset(&(action.sa_mask));
+    sigaction(kFatalSignals[i], &action, &(gOldSigActions[i]));
+  }
+  gTrace->writer = std::thread(WriteTrace);
+}
+
+// Get the trace ring of the current thread. This adopts the ring of an exited
+// thread if possible, and allocates a new ring otherwise.
+static TraceRing *GetRing(void) {
+  if (gRing.ring) return gRing.ring;
+  std::call_once(gTraceInit, InitTrace);
+  for (auto ring = gTrace->rings.load(std::memory_order_acquire);
+       ring; ring = ring->next) {
+    auto in_use = false;
+    if (ring->in_use.compare_exchange_strong(in_use, true)) {
+      gRing.ring = ring;
+      return ring;
+    }
+  }
+  auto ring = new TraceRing;
+  ring->head.store(0);
+  ring->tail.store(0);
+  ring->in_use.store(true);
+  ring->size = gTrace->ring_size;
+  ring->data = new uint8_t[ring->size];
+  ring->is_deferred = false;
+  ring->next = gTrace->rings.load();
+  while (!gTrace->rings.compare_exchange_weak(ring->next, ring)) {}
+  gRing.ring = ring;
+  return ring;
+}
+
+// Start a new trace record.
+static TraceRecord &BeginRecord(TraceTag tag, uint64_t id) {
+  Increment(GetStats().records[tag], 1);
+  gRecord.Clear(tag, id);
+  return gRecord;
+}
+
+// Finish the record started by `BeginRecord` by adding it to the current
+// thread's trace ring.
+static void EndRecord(void) {
+  auto ring = GetRing();
+  auto &rec = gEncodedRecord;
+  rec.clear();
+  EncodeRecord(gRecord, rec);
+
+  const auto size = rec.size();
+  const auto head = ring->head.load(std::memory_order_relaxed);
+  for (;;) {
+    const auto used = head - ring->tail.load(std::memory_order_acquire);
+    if (size <= ring->size - used) {
+      break;
+    } else if (kTracePolicyDrop == gTrace->policy || size > ring->size) {
+      gTrace->num_drops.fetch_add(1);
+      return;
+    } else if (gTrace->is_stopped.load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> locker(gTrace->lock);
+      DrainRings(true);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+
+  const auto pos = head & (ring->size - 1);
+  const auto first = std::min(size, ring->size - pos);
+  memcpy(&(ring->data[pos]), rec.data(), first);
+  memcpy(ring->data, &(rec[first]), size - first);
+  ring->head.store(head + size, std::memory_order_release);
+
+  // Nobody is left to drain the ring once the trace has been stopped.
+  if (gTrace->is_stopped.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> locker(gTrace->lock);
+    DrainRings(true);
+    FlushTrace();
+  }
+}
+
+// Inclusive ranges of the numbers of the blocks whose reads and writes are
+// traced. All blocks are traced if there are no ranges.
+static std::vector<std::pair<uint64_t, uint64_t>> gTracedBlocks INIT_FIRST;
+
+static bool IsTracedBlock(uint64_t nr) {
+  if (!IsTracing()) return false;
+  if (gTracedBlocks.empty()) return true;
+  for (const auto &range : gTracedBlocks) {
+    if (range.first <= nr && nr <= range.second) return true;
+  }
+  return false;
+}
+
+// Untaint `size` bytes of memory starting at `addr`. This costs one lookup of
+// the shadow directory per page, and only locks and writes the shadow pages
+// that already exist. Nothing is done if there is no shadow memory at all.
+static void Untaint(uint64_t addr, uint64_t size) {
+  if (!__fslice_shadow.load(std::memory_order_acquire)) return;
+  while (size) {
+    const auto offset = addr & kPageMask;
+    const auto len = std::min(size, kPageSize - offset);
+    DropLazyPage(addr, offset, offset + len);
+    if (auto page = GetPage(addr, false)) {
+      std::lock_guard<SpinLock> locker(page->lock);
+      WritePage(page, {static_cast<uint16_t>(offset),
+                       static_cast<uint16_t>(offset + len), false,
+                       {0, 0, false}});
+    }
+    addr += len;
+    size -= len;
+  }
+}
+
+// Turn tracing on or off. The file system under test can call these to only
+// trace some of its operations.
+extern "C" void __fslice_trace_on(void) {
+  gIsTracing.store(true, std::memory_order_relaxed);
+}
+
+extern "C" void __fslice_trace_off(void) {
+  gIsTracing.store(false, std::memory_order_relaxed);
+}
+
+// Read the tracing controls from the environment.
+//
+// `FSLICE_TRACE_BLOCKS` restricts tracing to the reads and writes of some
+// blocks, e.g. `FSLICE_TRACE_BLOCKS=0-63,1024`. Setting `FSLICE_TRACE_OFF`
+// starts the program with tracing off, until it calls `__fslice_trace_on`.
+// `FSLICE_TRACE_WINDOW=start[:stop]` only traces from `start` until `stop`
+// seconds after the program starts.
+static void InitTraceControls(void) {
+  if (auto blocks = getenv("FSLICE_TRACE_BLOCKS")) {
+    for (auto p = blocks; *p; ) {
+      char *end = nullptr;
+      const auto first = strtoull(p, &end, 0);
+      auto last = first;
+      if ('-' == *end) last = strtoull(end + 1, &end, 0);
+      if (end == p || (*end && ',' != *end)) {
+        std::cerr << "Malformed FSLICE_TRACE_BLOCKS: " << blocks << std::endl;
+        abort();
+      }
+      gTracedBlocks.push_back({first, last});
+      p = *end ? end + 1 : end;
+    }
+  }
+  if (getenv("FSLICE_TRACE_OFF")) gIsTracing.store(false);
+  if (auto window = getenv("FSLICE_TRACE_WINDOW")) {
+    char *end = nullptr;
+    const auto start = strtod(window, &end);
+    auto stop = -1.0;
+    if (':' == *end) stop = strtod(end + 1, nullptr);
+    if (0 < start) gIsTracing.store(false);
+    std::thread([=] (void) {
+      typedef std::chrono::duration<double> Seconds;
+      std::this_thread::sleep_for(Seconds(start));
+      gIsTracing.store(true);
+      if (stop < start) return;
+      std::this_thread::sleep_for(Seconds(stop - start));
+      gIsTracing.store(false);
+    }).detach();
+  }
+}
+
+// Reads the tracing controls at startup. This is initialized after the other
+// globals of the runtime, which are defined before it, but before the
+// instrumented module's constructors run and call hooks.
+static struct TraceControls {
+  TraceControls(void) {
+    InitTraceControls();
   }
-  std::cerr << ")" << std::endl;
+} gTraceControls INIT_FIRST;
+
+// Add a record that assigns `len` bytes starting at `src[src_offset]` to the
+// bytes starting at `dst[dst_offset]`. If `is_seq` is false then every byte is
+// assigned `src[src_offset]`.
+static void TraceAssign(uint64_t dst, uint64_t dst_offset,
+                        uint64_t src, uint64_t src_offset,
+                        uint64_t len, bool is_seq) {
+  if (!len) return;
+  auto &rec = BeginRecord(kTraceAssign, 0);
+  rec.refs.push_back({dst, dst_offset});
+  rec.refs.push_back({src, src_offset});
+  rec.nums.push_back(len);
+  rec.nums.push_back(1 < len && is_seq);
+  EndRecord();
+}
+
+// Create a new object node whose bytes have the taints `taints`.
+static Taint TraceObject(const Taint *taints, uint64_t size) {
+  const Taint t = {NewId(), 0, false};
+  auto &rec = BeginRecord(kTraceObject, t.id);
+  for (auto i = 0UL; i < size; ++i) {
+    rec.refs.push_back({taints[i].id, taints[i].offset});
+  }
+  EndRecord();
+  return t;
+}
+
+// Create a new slice node for the `size` bytes of `origin` starting at
+// `origin.offset`.
+static Taint TraceSlice(Taint origin, uint64_t size) {
+  const Taint t = {NewId(), 0, false};
+  auto &rec = BeginRecord(kTraceSlice, t.id);
+  rec.nums.push_back(size);
+  rec.refs.push_back({origin.id, origin.offset});
+  EndRecord();
   return t;
 }
 
+// Returns true if the `size` taints in `taints` are the consecutive bytes
+// `{id, k}, {id, k + 1}, ...` of a single origin. The differences are OR'd
+// together so that the loop has no branches and can be vectorized.
+static bool IsSlice(const Taint *taints, uint64_t size) {
+  const auto first = taints[0];
+  uint64_t diff = 0;
+  for (auto i = 1UL; i < size; ++i) {
+    diff |= taints[i].id ^ first.id;
+    diff |= taints[i].offset ^ (first.offset + i);
+    diff |= static_cast<uint64_t>(taints[i].is_obj ^ first.is_obj);
+  }
+  return !diff;
+}
+
+// Combine the shadow taints of the `size` bytes of a loaded value. Untainted
+// bytes produce a zero taint, just like the instrumentation's inline check of
+// the shadow. Consecutive bytes of a single origin produce a slice node, which
+// is cheaper to intern and trace than an object node.
+static Taint LoadTaints(const Taint *taints, uint64_t size) {
+  const auto origin = taints[0];
+  if (origin.id && IsSlice(taints, size)) {
+#if CACHE
+    CountLookup(kCacheSlices);
+    return gSlices.FindOrInsert(size, {origin.id, 0, false},
+                                {origin.offset, 0, false}, [=] (void) {
+      CountMiss(kCacheSlices);
+      return TraceSlice(origin, size);
+    });
+#else
+    return TraceSlice(origin, size);
+#endif
+  }
+  auto is_tainted = false;
+  for (auto i = 0UL; i < size && !is_tainted; ++i) {
+    is_tainted = 0 != taints[i].id;
+  }
+  if (!is_tainted) return {0, 0, false};
+#if CACHE
+  CountLookup(kCacheObjects);
+  return gObjects.FindOrInsert(taints, size, [=] (void) {
+    CountMiss(kCacheObjects);
+    return TraceObject(taints, size);
+  });
+#else
+  return TraceObject(taints, size);
+#endif
+}
+
+// Load a taint from the shadow memory.
+static Taint Load(uint64_t addr, uint64_t size) {
+  if (!IsTracing()) return {0, 0, false};
+  SaveErrno save_errno;
+  auto &taints = gLoadTaints;
+  if (taints.size() < size) taints.resize(size);
+  ReadShadow(addr, size, taints.data());
+  return LoadTaints(taints.data(), size);
+}
+
 // Store a taint to the shadow memory.
 static void Store(uint64_t addr, uint64_t size, Taint t) {
   SaveErrno save_errno;
-  for (auto i = 0U; i < size; ++i) {
-    auto &et = gShadow[addr + i];
-    if (et.is_obj) {
-      std::cerr << "t" << et.id << "[" << et.offset << "]=t" << t.id << "["
-                << (t.offset + i) << "]" << std::endl;
+  if (!IsTracing()) {
+    Untaint(addr, size);
+    return;
+  }
+  ForEachRun(addr, size, [=] (uint64_t baddr, uint64_t len, Taint et,
+                              bool is_seq) {
+    const auto i = baddr - addr;
+    if (!et.is_obj) {
+      WriteShadow(baddr, len, {t.id, t.offset + i, false}, true);
+      return;
+    }
+    // Every byte of a non-sequential run names the same object byte, so only
+    // the last assignment to it is visible.
+    if (is_seq) {
+      TraceAssign(et.id, et.offset, t.id, t.offset + i, len, true);
     } else {
-      et = {t.id, t.offset + i, false};  // should be `taint.offset + i`?
+      TraceAssign(et.id, et.offset, t.id, t.offset + i + len - 1, 1, true);
     }
-  }
+  });
 }
 
 #define LOAD_STORE(size) \
   extern "C" Taint __fslice_load ## size (uint64_t addr) { \
+    HookScope hook(kStatLoad ## size); \
     return Load(addr, size); \
   } \
   extern "C" void __fslice_store ## size (uint64_t addr, Taint taint) { \
+    HookScope hook(kStatStore ## size); \
     Store(addr, size, taint); \
   }
 
@@ -104,188 +2021,477 @@ LOAD_STORE(16)
 LOAD_STORE(32)
 LOAD_STORE(64)
 
+// Load the taints of `num_fields` fields of the object at `base` into
+// `taints`. `layout` holds the offset from `base` and the size of each field.
+// The shadow of the whole object is read at once.
+extern "C" void __fslice_load_fields(uint64_t base, const uint64_t *layout,
+                                     Taint *taints, uint64_t num_fields) {
+  HookScope hook(kStatLoadFields);
+  if (!IsTracing()) {
+    memset(taints, 0, num_fields * sizeof(Taint));
+    return;
+  }
+  SaveErrno save_errno;
+  // Offsets are negative if a field precedes `base`.
+  auto begin = static_cast<int64_t>(layout[0]);
+  auto end = begin + static_cast<int64_t>(layout[1]);
+  for (auto i = 1UL; i < num_fields; ++i) {
+    const auto offset = static_cast<int64_t>(layout[i * 2]);
+    begin = std::min(begin, offset);
+    end = std::max(end, offset + static_cast<int64_t>(layout[i * 2 + 1]));
+  }
+  const auto size = static_cast<uint64_t>(end - begin);
+  auto &shadow = gLoadTaints;
+  if (shadow.size() < size) shadow.resize(size);
+  ReadShadow(base + begin, size, shadow.data());
+  for (auto i = 0UL; i < num_fields; ++i) {
+    const auto offset = static_cast<int64_t>(layout[i * 2]);
+    taints[i] = LoadTaints(&(shadow[offset - begin]), layout[i * 2 + 1]);
+  }
+}
+
+// Store the taints of `num_fields` fields of the object at `base`, in the
+// order in which the fields were assigned. `layout` is as above.
+extern "C" void __fslice_store_fields(uint64_t base, const uint64_t *layout,
+                                      const Taint *taints,
+                                      uint64_t num_fields) {
+  HookScope hook(kStatStoreFields);
+  for (auto i = 0UL; i < num_fields; ++i) {
+    Store(base + layout[i * 2], layout[i * 2 + 1], taints[i]);
+  }
+}
+
 extern "C" Taint __fslice_load_ret(void) {
-  memset(gArgs, 0, sizeof gArgs);
-  const auto t = gReturn;
-  gReturn = {0,0,false};
+  const auto t = __fslice_ret;
+  __fslice_ret = {0,0,false};
   return t;
 }
 
 extern "C" void __fslice_store_ret(Taint taint) {
-  memset(gArgs, 0, sizeof gArgs);
-  gReturn = {taint.id, taint.offset, false};
+  __fslice_ret = {taint.id, taint.offset, false};
 }
 
 extern "C" Taint __fslice_load_arg(uint64_t i) {
-  const auto t = gArgs[i];
-  gArgs[i] = {0,0,false};
+  const auto t = __fslice_args[i];
+  __fslice_args[i] = {0,0,false};
   return t;
 }
 
 extern "C" void __fslice_store_arg(uint64_t i, Taint taint) {
-  gArgs[i] = {taint.id, taint.offset, false};
+  __fslice_args[i] = {taint.id, taint.offset, false};
 }
 
 extern "C" void *__fslice_memset(void *dst, int val, uint64_t size) {
   SaveErrno save_errno;
-  const auto t = __fslice_load_arg(1);
-  const auto daddr = reinterpret_cast<uint64_t>(dst);
-  for (auto i = 0U; i < size; ++i) {
-    gShadow[daddr + i] = t;
+  HookScope hook(kStatMemset);
+  if (IsTracing()) {
+    WriteShadow(reinterpret_cast<uint64_t>(dst), size, __fslice_load_arg(1),
+                false);
+  } else {
+    Untaint(reinterpret_cast<uint64_t>(dst), size);
   }
   __fslice_store_ret({0,0,false});
   return memset(dst, val, size);
 }
 
-extern "C" void *__fslice_memmove(void *dst, const void *src, uint64_t size) {
+// Collect the runs of taints of `size` bytes of memory starting at `saddr`.
+// The runs are relative to `saddr`.
+static void CopyShadow(uint64_t saddr, uint64_t size,
+                       std::vector<MemoryRun> &runs) {
+  ForEachRun(saddr, size, [&] (uint64_t addr, uint64_t len, Taint t,
+                               bool is_seq) {
+    runs.push_back({addr - saddr, len, {t.id, t.offset, false}, is_seq});
+  });
+}
+
+// Write the runs collected by `CopyShadow` to the memory starting at `daddr`,
+// stopping after `size` bytes.
+static void PasteShadow(uint64_t daddr, uint64_t size,
+                        const std::vector<MemoryRun> &runs) {
+  for (const auto &run : runs) {
+    if (run.offset >= size) break;
+    WriteShadow(daddr + run.offset, std::min(run.size, size - run.offset),
+                run.taint, run.is_seq);
+  }
+}
+
+// Copy the taints of `size` bytes of memory from `saddr` to `daddr`.
+static void MoveShadow(uint64_t daddr, uint64_t saddr, uint64_t size) {
+  // Collect the source runs before writing any of them, in case the source
+  // and destination overlap.
+  std::vector<MemoryRun> runs;
+  CopyShadow(saddr, size, runs);
+  PasteShadow(daddr, size, runs);
+}
+
+static void *MoveMemory(void *dst, const void *src, uint64_t size) {
   SaveErrno save_errno;
-  const auto daddr = reinterpret_cast<uint64_t>(dst);
-  const auto saddr = reinterpret_cast<uint64_t>(src);
-  for (auto i = 0U; i < size; ++i) {
-    const auto bt = gShadow[saddr + i];
-    gShadow[daddr + i] = {bt.id, bt.offset, false};
+  if (IsTracing()) {
+    MoveShadow(reinterpret_cast<uint64_t>(dst),
+               reinterpret_cast<uint64_t>(src), size);
+  } else {
+    Untaint(reinterpret_cast<uint64_t>(dst), size);
   }
   __fslice_store_ret({0,0,false});
   return memmove(dst, src, size);
 }
 
+extern "C" void *__fslice_memmove(void *dst, const void *src, uint64_t size) {
+  HookScope hook(kStatMemmove);
+  return MoveMemory(dst, src, size);
+}
+
 extern "C" void *__fslice_memcpy(void *dst, const void *src, uint64_t size) {
-  return __fslice_memmove(dst, src, size);
+  HookScope hook(kStatMemcpy);
+  return MoveMemory(dst, src, size);
 }
 
 extern "C" char *__fslice_strcpy(char *dst, const char *src) {
-  return reinterpret_cast<char *>(__fslice_memmove(dst, src, strlen(src) + 1));
+  HookScope hook(kStatStrcpy);
+  return reinterpret_cast<char *>(MoveMemory(dst, src, strlen(src) + 1));
 }
 
 extern "C" void __fslice_bzero(void *dst, uint64_t size) {
-  const auto daddr = reinterpret_cast<uint64_t>(dst);
-  for (auto i = 0U; i < size; ++i) {
-    gShadow[daddr + i] = {0,0,false};
+  HookScope hook(kStatBzero);
+  if (IsTracing()) {
+    WriteShadow(reinterpret_cast<uint64_t>(dst), size, {0,0,false}, false);
+  } else {
+    Untaint(reinterpret_cast<uint64_t>(dst), size);
   }
   __fslice_store_ret({0,0,false});
   memset(dst, 0, size);
 }
 
 extern "C" void *__fslice_malloc(uint64_t size) {
+  HookScope hook(kStatMalloc);
   auto ptr = calloc(1, size);
-  const auto addr = reinterpret_cast<uint64_t>(ptr);
-  Taint t = {gId++, 0};
-  std::cerr << "t" << t.id << "=M(" << size << ",t"
-            << __fslice_load_arg(0).id << ")" << std::endl;
-  for (auto i = 0U; i < size; ++i) {
-    gShadow[addr + i] = {t.id, i, MEM};
-  }
   __fslice_store_ret({0,0,false});
+  if (!IsTracing()) return ptr;
+  const auto addr = reinterpret_cast<uint64_t>(ptr);
+  const Taint t = {NewId(), 0};
+  auto &rec = BeginRecord(kTraceMalloc, t.id);
+  rec.nums.push_back(size);
+  rec.refs.push_back({__fslice_load_arg(0).id, 0});
+  EndRecord();
+  WriteShadow(addr, size, {t.id, 0, MEM}, true);
   return ptr;
 }
 
 extern "C" void *__fslice_calloc(uint64_t num, uint64_t size) {
+  HookScope hook(kStatCalloc);
   auto ptr = calloc(num, size);
-  const auto addr = reinterpret_cast<uint64_t>(ptr);
-  Taint t = {gId++, 0};
-  std::cerr << "t" << t.id << "=M(" << size << ",t"
-            << __fslice_load_arg(0).id << ",t"
-            << __fslice_load_arg(0).id << ")" << std::endl;
-  for (auto i = 0U; i < num * size; ++i) {
-    gShadow[addr + i] = {t.id, i, MEM};
-  }
   __fslice_store_ret({0,0,false});
+  if (!IsTracing()) return ptr;
+  const auto addr = reinterpret_cast<uint64_t>(ptr);
+  const Taint t = {NewId(), 0};
+  auto &rec = BeginRecord(kTraceMalloc, t.id);
+  rec.nums.push_back(size);
+  rec.refs.push_back({__fslice_load_arg(0).id, 0});
+  rec.refs.push_back({__fslice_load_arg(0).id, 0});
+  EndRecord();
+  WriteShadow(addr, num * size, {t.id, 0, MEM}, true);
   return ptr;
 }
 
-extern "C" Taint __fslice_value(uint64_t val) {
+extern "C" void __fslice_free(void *ptr) {
+  HookScope hook(kStatFree);
+  if (ptr) {
+    SaveErrno save_errno;
+    ClearShadow(reinterpret_cast<uint64_t>(ptr), malloc_usable_size(ptr));
+  }
+  free(ptr);
+}
+
+// Reallocate `ptr`. The bytes kept from the old allocation keep their taints,
+// and any new bytes belong to a new allocation node. A null `ptr` keeps no
+// bytes, so all of the new allocation belongs to the new node, whose size
+// taint is that of `size`.
+//
+// The old allocation's taints are cleared before calling `realloc`, because
+// once it returns, another thread might already have reused the old memory.
+extern "C" void *__fslice_realloc(void *ptr, uint64_t size) {
+  HookScope hook(kStatRealloc);
+  const auto addr = reinterpret_cast<uint64_t>(ptr);
+  const auto old_size = ptr ? malloc_usable_size(ptr) : 0;
+  std::vector<MemoryRun> runs;
+  if (ptr) {
+    CopyShadow(addr, old_size, runs);
+    ClearShadow(addr, old_size);
+  }
+
+  const auto new_ptr = realloc(ptr, size);
+  __fslice_store_ret({0,0,false});
+  if (!new_ptr) {
+    if (ptr && size) PasteShadow(addr, old_size, runs);
+    return new_ptr;
+  }
+
   SaveErrno save_errno;
-#if CACHE
-  auto &t = gValues[val];
-  if (val && !t.id) {
-    Taint t = {gId++, 0, false};
-    std::cerr << "t" << t.id << "=V(" << val << ")" << std::endl;
+  const auto new_addr = reinterpret_cast<uint64_t>(new_ptr);
+  const auto kept_size = std::min<uint64_t>(old_size, size);
+  PasteShadow(new_addr, kept_size, runs);
+  if (kept_size < size && IsTracing()) {
+    const Taint t = {NewId(), 0};
+    auto &rec = BeginRecord(kTraceMalloc, t.id);
+    rec.nums.push_back(size);
+    rec.refs.push_back({__fslice_load_arg(1).id, 0});
+    EndRecord();
+    WriteShadow(new_addr + kept_size, size - kept_size, {t.id, kept_size, MEM},
+                true);
   }
+  return new_ptr;
+}
+
+// Clear the taints of a dead stack allocation.
+extern "C" void __fslice_clear(uint64_t addr, uint64_t size) {
+  SaveErrno save_errno;
+  HookScope hook(kStatClear);
+  ClearShadow(addr, size);
+}
+
+// Create a new value node for `val`.
+static Taint TraceValue(uint64_t val) {
+  const Taint t = {NewId(), 0, false};
+  BeginRecord(kTraceValue, t.id).nums.push_back(val);
+  EndRecord();
   return t;
+}
+
+// Get the value node for `val`.
+static Taint GetValue(uint64_t val) {
+  if (!val) return {0, 0, false};
+#if CACHE
+  CountLookup(kCacheValues);
+  return gValues.FindOrInsert(val, [=] (void) {
+    CountMiss(kCacheValues);
+    return TraceValue(val);
+  });
 #else
-  if (val) {
-    Taint t = {gId++, 0, false};
-    std::cerr << "t" << t.id << "=V(" << val << ")" << std::endl;
-    return t;
-  } else {
-    return {0, 0, false};
-  }
+  return TraceValue(val);
 #endif
 }
 
-extern "C" Taint __fslice_op2(const char *op, Taint t1, Taint t2) {
+extern "C" Taint __fslice_value(uint64_t val) {
   SaveErrno save_errno;
-#if CACHE
-  const auto id = t1.id | (static_cast<uint64_t>(t2.id) << 32);
-  auto &t = gBinaryOps[op][id];
-  if (!t.id) {
-    t = {gId++, 0, false};
-    std::cerr << "t" << t.id << "=A(\"" << op << "\",t" << t1.id
-              << ",t" << t2.id << ")" << std::endl;
+  HookScope hook(kStatValue);
+  if (!IsTracing()) return {0, 0, false};
+  return GetValue(val);
+}
+
+// Fill in a module's table of the taints of its integer constants. This is
+// called once per module at startup, so that instrumented code can load the
+// taint of a constant instead of calling `__fslice_value`. The table is filled
+// in even if tracing is off, as it is never filled in again.
+extern "C" void __fslice_register_values(const uint64_t *vals, Taint *taints,
+                                         uint64_t num_vals) {
+  SaveErrno save_errno;
+  HookScope hook(kStatRegisterValues);
+  for (auto i = 0UL; i < num_vals; ++i) {
+    taints[i] = GetValue(vals[i]);
+  }
+}
+
+// Register the descriptions of the module's hook call sites. Setting
+// `FSLICE_PROFILE` to a path makes the runtime profile the hooks by call site,
+// and write the profile there when the program exits.
+extern "C" void __fslice_register_sites(const char * const *sites,
+                                        uint64_t num_sites) {
+  const auto path = getenv("FSLICE_PROFILE");
+  if (!path) return;
+  if (gSites) {
+    std::cerr << "FSlice can only profile the sites of one module."
+              << std::endl;
+    return;
   }
+  gSites = sites;
+  gNumSites = num_sites;
+  gProfilePath = path;
+  atexit(DumpProfile);
+}
+
+// Register the names of a module's function summaries, and fill in `ops` with
+// the opcodes of their `A` nodes. Summaries that are registered after the
+// trace has started are announced with a new record of the opcode names.
+extern "C" void __fslice_register_summaries(const char * const *names,
+                                            uint64_t *ops,
+                                            uint64_t num_summaries) {
+  std::lock_guard<std::mutex> locker(gSummaryLock);
+  const auto first_op = kNumBinaryOps + gSummaryNames.size();
+  gSummaryNames.insert(gSummaryNames.end(), names, names + num_summaries);
+  if (gSummaryNamesTraced) {
+    std::lock_guard<std::mutex> trace_locker(gTrace->lock);
+    gTrace->op_names.insert(gTrace->op_names.end(), names,
+                            names + num_summaries);
+
+    // Write out the records in the threads' rings first, so that the new `P`
+    // record follows them in the trace. The new opcodes are only handed out
+    // below, so any record that uses one of them comes after the `P` record.
+    // Records that are still held back can't use the new opcodes.
+    if (gTrace->is_binary) {
+      DrainRings(false);
+      auto &rec = gTrace->rec;
+      rec.Clear(kTraceOpNames, 0);
+      rec.names = gTrace->op_names;
+      EncodeRecord(rec, gTrace->buffer);
+    }
+  }
+  for (auto i = 0UL; i < num_summaries; ++i) ops[i] = first_op + i;
+}
+
+// Create a new node for the binary operator `op`, which is an index into
+// `kBinaryOpNames`.
+static Taint TraceOp(uint64_t op, Taint t1, Taint t2) {
+  const Taint t = {NewId(), 0, false};
+  auto &rec = BeginRecord(kTraceOp, t.id);
+  rec.nums.push_back(op);
+  rec.refs.push_back({t1.id, 0});
+  rec.refs.push_back({t2.id, 0});
+  EndRecord();
+  return t;
+}
+
+// Get the node for the operator `op` applied to `t1` and `t2`.
+static Taint GetOp(uint64_t op, Taint t1, Taint t2) {
+#if CACHE
+  CountLookup(kCacheBinaryOps);
+  return gBinaryOps.FindOrInsert(op, t1, t2, [=] (void) {
+    CountMiss(kCacheBinaryOps);
+    return TraceOp(op, t1, t2);
+  });
 #else
-  Taint t = {gId++, 0, false};
-  std::cerr << "t" << t.id << "=A(\"" << op << "\",t" << t1.id
-            << ",t" << t2.id << ")" << std::endl;
+  return TraceOp(op, t1, t2);
 #endif
+}
+
+extern "C" Taint __fslice_op2(uint64_t op, Taint t1, Taint t2) {
+  SaveErrno save_errno;
+  HookScope hook(kStatOp2);
+  if (!IsTracing()) return {0, 0, false};
+  return GetOp(op, t1, t2);
+}
+
+// Summarize a call to a pure function, whose result depends only on the
+// taints of its first `num_args` arguments and on the memory that its pointer
+// arguments point to. `ranges` holds the address and size of each range of
+// that memory, where a size of `~0` means a NUL-terminated string. The result
+// is one chain of `A` nodes of the summary's opcode `op` over the non-zero
+// input taints. The argument taints are cleared, as the summarized function
+// doesn't read them itself.
+extern "C" Taint __fslice_summary(uint64_t op, uint64_t num_args,
+                                  const uint64_t *ranges,
+                                  uint64_t num_ranges) {
+  SaveErrno save_errno;
+  HookScope hook(kStatSummary);
+  auto &inputs = gSummaryInputs;
+  inputs.clear();
+  for (auto i = 0UL; i < num_args; ++i) {
+    const auto t = __fslice_load_arg(i);
+    if (t.id) inputs.push_back(t);
+  }
+  if (!IsTracing()) return {0, 0, false};
+  for (auto i = 0UL; i < num_ranges; ++i) {
+    const auto addr = ranges[i * 2];
+    auto size = ranges[i * 2 + 1];
+    if (~0ULL == size) size = strlen(reinterpret_cast<char *>(addr)) + 1;
+    if (!size) continue;
+    const auto t = Load(addr, size);
+    if (t.id) inputs.push_back(t);
+  }
+  if (inputs.empty()) return {0, 0, false};
+  auto t = GetOp(op, inputs[0], {0, 0, false});
+  for (auto i = 1UL; i < inputs.size(); ++i) t = GetOp(op, t, inputs[i]);
   return t;
 }
 
 static Taint GetBlock(uint64_t size, uint64_t nr) {
-  auto &t = gBlocks[nr];
-  if (!t.id) {
-    t = {gId++,0, false};
+  CountLookup(kCacheBlocks);
+  return gBlocks.FindOrInsert(nr, [=] (void) {
+    CountMiss(kCacheBlocks);
+    const Taint t = {NewId(), 0, false};
     const auto st = __fslice_load_arg(1);  // Taint for the size :-)
     const auto nt = __fslice_load_arg(2);  // Taint for the block number :-)
-    std::cerr << "t" << t.id << "=B(" << size << "," << nr << ",t"
-              << st.id << ",t" << nt.id << ")" << std::endl;
+    auto &rec = BeginRecord(kTraceBlock, t.id);
+    rec.nums.push_back(size);
+    rec.nums.push_back(nr);
+    rec.refs.push_back({st.id, 0});
+    rec.refs.push_back({nt.id, 0});
+    EndRecord();
     __fslice_store_ret({0,0,false});
-  }
-  return t;
+    return t;
+  });
 }
 
 extern "C" void __fslice_read_block(uint64_t addr, uint64_t size, uint64_t nr) {
   SaveErrno save_errno;
-  auto t = GetBlock(size, nr);
-  for (auto i = 0U; i < size; ++i) {
-    gShadow[addr + i] = {t.id, i, false};
+  HookScope hook(kStatReadBlock);
+  if (!IsTracedBlock(nr)) {
+    Untaint(addr, size);
+    return;
   }
+  auto t = GetBlock(size, nr);
+#if LAZY
+  WriteLazyBlock(addr, size, t);
+#else
+  WriteShadow(addr, size, {t.id, 0, false}, true);
+#endif
 }
 
 // Mark some memory as a block.
 extern "C" void __fslice_write_block(uint64_t addr, uint64_t size,
                                      uint64_t nr) {
   SaveErrno save_errno;
+  HookScope hook(kStatWriteBlock);
+  if (!IsTracedBlock(nr)) return;
   auto t = GetBlock(size, nr);
-  for (auto i = 0UL; i < size; ++i) {
-    const auto bt = gShadow[addr + i];
-    if (!bt.id || (t.id == bt.id && i == bt.offset)) continue;
-    std::cerr << "t" << t.id << "[" << i << "]=t" << bt.id
-              << "[" << bt.offset << "]" << std::endl;
-  }
+  ForEachRun(addr, size, [=] (uint64_t baddr, uint64_t len, Taint bt,
+                              bool is_seq) {
+    if (!bt.id) return;
+    const auto i = baddr - addr;
+    if (t.id != bt.id) {
+      TraceAssign(t.id, i, bt.id, bt.offset, len, is_seq);
+
+    // Skip the bytes that already hold themselves.
+    } else if (is_seq) {
+      if (i != bt.offset) TraceAssign(t.id, i, bt.id, bt.offset, len, true);
+    } else if (bt.offset < i || bt.offset >= i + len) {
+      TraceAssign(t.id, i, bt.id, bt.offset, len, false);
+    } else {
+      TraceAssign(t.id, i, bt.id, bt.offset, bt.offset - i, false);
+      TraceAssign(t.id, bt.offset + 1, bt.id, bt.offset,
+                  i + len - bt.offset - 1, false);
+    }
+  });
 }
 
 // Mark some memory as a name.
 extern "C" void __fslice_name(uint64_t addr, uint64_t len) {
   SaveErrno save_errno;
-  Taint t = {gId++, 0};
-  std::cerr << "t" << t.id << "=N(" << len << ")" << std::endl;
-  for (auto i = 0U; i < len; ++i) {
-    gShadow[addr + i] = {t.id, i, false};
+  HookScope hook(kStatName);
+  if (!IsTracing()) {
+    Untaint(addr, len);
+    return;
   }
+  const Taint t = {NewId(), 0};
+  BeginRecord(kTraceName, t.id).nums.push_back(len);
+  EndRecord();
+  WriteShadow(addr, len, {t.id, 0, false}, true);
 }
 
 // Mark some memory as data.
 extern "C" void __fslice_data(uint64_t addr, uint64_t len) {
   SaveErrno save_errno;
-  Taint t = {gId++, 0};
-  std::cerr << "t" << t.id << "=D(" << len << ")" << std::endl;
-  for (auto i = 0U; i < len; ++i) {
-    auto &bt = gShadow[addr + i];
-    if (bt.id) {
-      std::cerr << "t" << t.id << "[" << i << "]=t" << bt.id
-                << "[" << bt.offset << "]" << std::endl;
-    }
-    bt = {t.id, i, false};
+  HookScope hook(kStatData);
+  if (!IsTracing()) {
+    Untaint(addr, len);
+    return;
   }
+  const Taint t = {NewId(), 0};
+  BeginRecord(kTraceData, t.id).nums.push_back(len);
+  EndRecord();
+  ForEachRun(addr, len, [=] (uint64_t baddr, uint64_t blen, Taint bt,
+                             bool is_seq) {
+    if (!bt.id) return;
+    TraceAssign(t.id, baddr - addr, bt.id, bt.offset, blen, is_seq);
+  });
+  WriteShadow(addr, len, {t.id, 0, false}, true);
 }
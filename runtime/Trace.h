@@ -0,0 +1,515 @@
+/* Copyright 2015 Peter Goodman (peter@trailofbits.com), all rights reserved. */
+
+#ifndef FSLICE_RUNTIME_TRACE_H_
+#define FSLICE_RUNTIME_TRACE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Binary trace format. A binary trace starts with `kTraceMagic`, and is
+// followed by a sequence of records. Each record is a tag byte followed by
+// LEB128-encoded integers. Strings are encoded as a length followed by the
+// bytes of the string. A binary trace starts with a `P` record that names the
+// opcodes used by `A` records.
+//
+// Ids are 64 bits. The ids that a record references, written `t1`, `src_id`
+// and so on below, are encoded either as is or relative to the record's own
+// id (`dst_id` for `=` records), whichever is shorter. References to recent
+// nodes thus stay short no matter how long the run is. See `EncodeRefId`.
+//
+//    P     n (name)*n
+//    V     id value
+//    A     id opcode t1 t2
+//    O     id n (id offset)*n
+//    S     id src_id src_offset len
+//    B     id size nr size_id nr_id
+//    N     id len
+//    D     id len
+//    M     id size n (id)*n
+//    =     dst_id dst_offset src_id src_offset len is_seq
+//
+// An `=` record assigns `len` consecutive bytes of `dst`. If `is_seq` is set
+// then the source bytes are consecutive too, otherwise every destination byte
+// is assigned the same source byte.
+//
+// The text format is a sequence of Python statements that are evaluated in the
+// context of `visualize/head.py`. Multi-byte assignments use slices, e.g.
+// `t5[0:4096]=t3[512:4608]` or `t5[0:16]=t3[7]`.
+
+enum : uint64_t {
+  kTraceMagicSize = 8,
+  kMaxVarintSize = 10
+};
+
+static const char kTraceMagic[kTraceMagicSize] = {
+    'F', 'S', 'L', 'I', 'C', 'E', '\0', 5};
+
+enum TraceTag : uint8_t {
+  kTraceOpNames = 'P',
+  kTraceValue = 'V',
+  kTraceOp = 'A',
+  kTraceObject = 'O',
+  kTraceSlice = 'S',
+  kTraceBlock = 'B',
+  kTraceName = 'N',
+  kTraceData = 'D',
+  kTraceMalloc = 'M',
+  kTraceAssign = '='
+};
+
+// Reference to a byte (or the start) of a taint node.
+struct TraceRef {
+  uint64_t id;
+  uint64_t offset;
+};
+
+// A decoded trace record. The meaning of `nums` and `refs` depends on the tag.
+//
+//    P     names = opcode names
+//    V     nums = {value}
+//    A     nums = {opcode}, refs = {t1, t2}
+//    O     refs = bytes of the object
+//    S     nums = {len}, refs = {first byte of the source}
+//    B     nums = {size, nr}, refs = {size taint, nr taint}
+//    N, D  nums = {len}
+//    M     nums = {size}, refs = size taints
+//    =     nums = {len, is_seq}, refs = {dst, src}
+struct TraceRecord {
+  TraceTag tag;
+  uint64_t id;
+  std::vector<std::string> names;
+  std::vector<uint64_t> nums;
+  std::vector<TraceRef> refs;
+
+  void Clear(TraceTag tag_, uint64_t id_) {
+    tag = tag_;
+    id = id_;
+    names.clear();
+    nums.clear();
+    refs.clear();
+  }
+};
+
+// Encode `val` as a LEB128 integer into `out`. Returns the number of bytes
+// written, which is at most `kMaxVarintSize`.
+inline unsigned EncodeVarint(uint64_t val, uint8_t *out) {
+  auto i = 0U;
+  do {
+    auto b = static_cast<uint8_t>(val & 0x7F);
+    val >>= 7;
+    out[i++] = val ? (b | 0x80) : b;
+  } while (val);
+  return i;
+}
+
+// Decode a LEB128 integer from `[p, end)`. Returns false if the input is
+// truncated.
+inline bool DecodeVarint(const uint8_t *&p, const uint8_t *end,
+                         uint64_t &val) {
+  val = 0;
+  for (auto shift = 0U; p < end && shift < 64; shift += 7) {
+    const auto b = *p++;
+    val |= static_cast<uint64_t>(b & 0x7F) << shift;
+    if (!(b & 0x80)) return true;
+  }
+  return false;
+}
+
+// Encode the id `id` that is referenced by a record whose own id is `base`.
+// The low bit selects between the id itself, and its zigzag-encoded distance
+// from `base`, whichever is smaller. The zero id always encodes as zero.
+inline uint64_t EncodeRefId(uint64_t id, uint64_t base) {
+  const auto delta = static_cast<int64_t>(base - id);
+  const auto zigzag = (static_cast<uint64_t>(delta) << 1) ^
+                      static_cast<uint64_t>(delta >> 63);
+  const auto abs_val = id << 1;
+  if (!id || (zigzag >> 62)) return abs_val;
+  return std::min(abs_val, (zigzag << 1) | 1);
+}
+
+// Decode an id that was encoded by `EncodeRefId`.
+inline uint64_t DecodeRefId(uint64_t val, uint64_t base) {
+  if (!(val & 1)) return val >> 1;
+  const auto zigzag = val >> 1;
+  return base - ((zigzag >> 1) ^ (0 - (zigzag & 1)));
+}
+
+// Encode a record into `out`.
+inline void EncodeRecord(const TraceRecord &rec, std::string &out) {
+  uint8_t buf[kMaxVarintSize];
+  auto put = [&] (uint64_t val) {
+    out.append(reinterpret_cast<char *>(buf), EncodeVarint(val, buf));
+  };
+  auto put_ref = [&] (uint64_t id, uint64_t base) {
+    put(EncodeRefId(id, base));
+  };
+  out.push_back(static_cast<char>(rec.tag));
+  switch (rec.tag) {
+    case kTraceOpNames:
+      put(rec.names.size());
+      for (const auto &name : rec.names) {
+        put(name.size());
+        out.append(name);
+      }
+      break;
+    case kTraceValue:
+    case kTraceName:
+    case kTraceData:
+      put(rec.id);
+      put(rec.nums[0]);
+      break;
+    case kTraceOp:
+      put(rec.id);
+      put(rec.nums[0]);
+      put_ref(rec.refs[0].id, rec.id);
+      put_ref(rec.refs[1].id, rec.id);
+      break;
+    case kTraceObject:
+      put(rec.id);
+      put(rec.refs.size());
+      for (const auto &ref : rec.refs) {
+        put_ref(ref.id, rec.id);
+        put(ref.offset);
+      }
+      break;
+    case kTraceSlice:
+      put(rec.id);
+      put_ref(rec.refs[0].id, rec.id);
+      put(rec.refs[0].offset);
+      put(rec.nums[0]);
+      break;
+    case kTraceBlock:
+      put(rec.id);
+      put(rec.nums[0]);
+      put(rec.nums[1]);
+      put_ref(rec.refs[0].id, rec.id);
+      put_ref(rec.refs[1].id, rec.id);
+      break;
+    case kTraceMalloc:
+      put(rec.id);
+      put(rec.nums[0]);
+      put(rec.refs.size());
+      for (const auto &ref : rec.refs) put_ref(ref.id, rec.id);
+      break;
+    case kTraceAssign:
+      put(rec.refs[0].id);
+      put(rec.refs[0].offset);
+      put_ref(rec.refs[1].id, rec.refs[0].id);
+      put(rec.refs[1].offset);
+      put(rec.nums[0]);
+      put(rec.nums[1]);
+      break;
+  }
+}
+
+// Decode one record from `[p, end)` into `rec`. Returns false if the input
+// is truncated or malformed.
+inline bool DecodeRecord(const uint8_t *&p, const uint8_t *end,
+                         TraceRecord &rec) {
+  if (p >= end) return false;
+  const auto tag = static_cast<TraceTag>(*p++);
+  uint64_t a = 0, b = 0, n = 0;
+  auto get = [&] (uint64_t &val) {
+    return DecodeVarint(p, end, val);
+  };
+  auto get_ref = [&] (uint64_t &id, uint64_t base) {
+    if (!DecodeVarint(p, end, id)) return false;
+    id = DecodeRefId(id, base);
+    return true;
+  };
+  rec.Clear(tag, 0);
+  switch (tag) {
+    case kTraceOpNames:
+      if (!get(n)) return false;
+      for (auto i = 0UL; i < n; ++i) {
+        if (!get(a) || static_cast<uint64_t>(end - p) < a) return false;
+        rec.names.emplace_back(reinterpret_cast<const char *>(p), a);
+        p += a;
+      }
+      return true;
+    case kTraceValue:
+    case kTraceName:
+    case kTraceData:
+      if (!get(rec.id) || !get(a)) return false;
+      rec.nums.push_back(a);
+      return true;
+    case kTraceOp:
+      if (!get(rec.id) || !get(n) || !get_ref(a, rec.id) ||
+          !get_ref(b, rec.id)) return false;
+      rec.nums.push_back(n);
+      rec.refs.push_back({a, 0});
+      rec.refs.push_back({b, 0});
+      return true;
+    case kTraceObject:
+      if (!get(rec.id) || !get(n)) return false;
+      for (auto i = 0UL; i < n; ++i) {
+        if (!get_ref(a, rec.id) || !get(b)) return false;
+        rec.refs.push_back({a, b});
+      }
+      return true;
+    case kTraceSlice:
+      if (!get(rec.id) || !get_ref(a, rec.id) || !get(b) || !get(n)) {
+        return false;
+      }
+      rec.refs.push_back({a, b});
+      rec.nums.push_back(n);
+      return true;
+    case kTraceBlock:
+      if (!get(rec.id) || !get(a) || !get(b)) return false;
+      rec.nums.push_back(a);
+      rec.nums.push_back(b);
+      if (!get_ref(a, rec.id) || !get_ref(b, rec.id)) return false;
+      rec.refs.push_back({a, 0});
+      rec.refs.push_back({b, 0});
+      return true;
+    case kTraceMalloc:
+      if (!get(rec.id) || !get(a) || !get(n)) return false;
+      rec.nums.push_back(a);
+      for (auto i = 0UL; i < n; ++i) {
+        if (!get_ref(b, rec.id)) return false;
+        rec.refs.push_back({b, 0});
+      }
+      return true;
+    case kTraceAssign:
+      rec.refs.resize(2);
+      rec.nums.resize(2);
+      return get(rec.refs[0].id) && get(rec.refs[0].offset) &&
+             get_ref(rec.refs[1].id, rec.refs[0].id) &&
+             get(rec.refs[1].offset) &&
+             get(rec.nums[0]) && get(rec.nums[1]);
+  }
+  return false;
+}
+
+// Append the Python statement for a record to `out`. `op_names` maps the
+// opcodes of `A` records to their names.
+inline void FormatRecord(const TraceRecord &rec,
+                         const std::vector<std::string> &op_names,
+                         std::string &out) {
+  auto num = [&] (uint64_t val) {
+    char buf[24];
+    auto i = sizeof buf;
+    do {
+      buf[--i] = static_cast<char>('0' + (val % 10));
+      val /= 10;
+    } while (val);
+    out.append(&(buf[i]), sizeof buf - i);
+  };
+  auto id = [&] (uint64_t val) {
+    out.push_back('t');
+    num(val);
+  };
+  auto byte = [&] (const TraceRef &ref) {
+    id(ref.id);
+    out.push_back('[');
+    num(ref.offset);
+    out.push_back(']');
+  };
+  auto bytes = [&] (const TraceRef &ref, uint64_t len) {
+    id(ref.id);
+    out.push_back('[');
+    num(ref.offset);
+    out.push_back(':');
+    num(ref.offset + len);
+    out.push_back(']');
+  };
+
+  if (kTraceOpNames == rec.tag) return;
+
+  if (kTraceAssign == rec.tag) {
+    const auto len = rec.nums[0];
+    if (1 == len) {
+      byte(rec.refs[0]);
+      out.push_back('=');
+      byte(rec.refs[1]);
+    } else {
+      bytes(rec.refs[0], len);
+      out.push_back('=');
+      if (rec.nums[1]) {
+        bytes(rec.refs[1], len);
+      } else {
+        byte(rec.refs[1]);
+      }
+    }
+    out.push_back('\n');
+    return;
+  }
+
+  id(rec.id);
+  out.push_back('=');
+  out.push_back(static_cast<char>(rec.tag));
+  out.push_back('(');
+  switch (rec.tag) {
+    case kTraceValue:
+    case kTraceName:
+    case kTraceData:
+      num(rec.nums[0]);
+      break;
+    case kTraceOp:
+      out.push_back('"');
+      if (rec.nums[0] < op_names.size()) {
+        out.append(op_names[rec.nums[0]]);
+      } else {
+        out.push_back('?');
+      }
+      out.append("\",");
+      id(rec.refs[0].id);
+      out.push_back(',');
+      id(rec.refs[1].id);
+      break;
+    case kTraceObject: {
+      auto sep = "";
+      for (const auto &ref : rec.refs) {
+        out.append(sep);
+        byte(ref);
+        sep = ",";
+      }
+      break;
+    }
+    case kTraceSlice:
+      id(rec.refs[0].id);
+      out.push_back(',');
+      num(rec.refs[0].offset);
+      out.push_back(',');
+      num(rec.nums[0]);
+      break;
+    case kTraceBlock:
+      num(rec.nums[0]);
+      out.push_back(',');
+      num(rec.nums[1]);
+      out.push_back(',');
+      id(rec.refs[0].id);
+      out.push_back(',');
+      id(rec.refs[1].id);
+      break;
+    case kTraceMalloc:
+      num(rec.nums[0]);
+      for (const auto &ref : rec.refs) {
+        out.push_back(',');
+        id(ref.id);
+      }
+      break;
+    case kTraceOpNames:
+    case kTraceAssign:
+      break;
+  }
+  out.append(")\n");
+}
+
+// Parse the text form of a record from the line `[p, end)`, which excludes the
+// trailing newline. This is the inverse of `FormatRecord`. The opcode names of
+// `A` records are looked up in, or added to, `op_names`. Returns false if the
+// line is malformed.
+inline bool ParseRecord(const char *p, const char *end,
+                        std::vector<std::string> &op_names,
+                        TraceRecord &rec) {
+  auto eat = [&] (char c) {
+    if (p >= end || c != *p) return false;
+    ++p;
+    return true;
+  };
+  auto num = [&] (uint64_t &val) {
+    if (p >= end || '0' > *p || '9' < *p) return false;
+    for (val = 0; p < end && '0' <= *p && '9' >= *p; ++p) {
+      val = val * 10 + static_cast<uint64_t>(*p - '0');
+    }
+    return true;
+  };
+  auto id = [&] (uint64_t &val) {
+    return eat('t') && num(val);
+  };
+  auto byte = [&] (TraceRef &ref) {
+    return id(ref.id) && eat('[') && num(ref.offset) && eat(']');
+  };
+
+  uint64_t a = 0, b = 0, n = 0;
+  rec.Clear(kTraceAssign, 0);
+  if (!id(a)) return false;
+
+  // Assignment: `tD[a]=tS[b]`, `tD[a:a+n]=tS[b:b+n]` or `tD[a:a+n]=tS[b]`.
+  if (eat('[')) {
+    TraceRef dst = {a, 0}, src = {0, 0};
+    if (!num(dst.offset)) return false;
+    n = dst.offset + 1;
+    if (eat(':') && !num(n)) return false;
+    if (!eat(']') || !eat('=') || !id(src.id) || !eat('[') ||
+        !num(src.offset)) return false;
+    const auto is_seq = eat(':');
+    if ((is_seq && !num(b)) || !eat(']') || p != end) return false;
+    if (n <= dst.offset) return false;
+    rec.refs.push_back(dst);
+    rec.refs.push_back(src);
+    rec.nums.push_back(n - dst.offset);
+    rec.nums.push_back(is_seq && 1 < n - dst.offset);
+    return true;
+  }
+
+  if (!eat('=') || p >= end) return false;
+  rec.tag = static_cast<TraceTag>(*p++);
+  rec.id = a;
+  if (!eat('(')) return false;
+  switch (rec.tag) {
+    case kTraceValue:
+    case kTraceName:
+    case kTraceData:
+      if (!num(a)) return false;
+      rec.nums.push_back(a);
+      break;
+    case kTraceOp: {
+      if (!eat('"')) return false;
+      const auto name = p;
+      while (p < end && '"' != *p) ++p;
+      const auto len = static_cast<size_t>(p - name);
+      auto op = 0UL;
+      for (; op < op_names.size(); ++op) {
+        const auto &op_name = op_names[op];
+        if (op_name.size() == len && !memcmp(op_name.data(), name, len)) break;
+      }
+      if (op == op_names.size()) op_names.emplace_back(name, len);
+      if (!eat('"') || !eat(',') || !id(a) || !eat(',') || !id(b)) {
+        return false;
+      }
+      rec.nums.push_back(op);
+      rec.refs.push_back({a, 0});
+      rec.refs.push_back({b, 0});
+      break;
+    }
+    case kTraceObject:
+      do {
+        rec.refs.push_back({0, 0});
+        if (!byte(rec.refs.back())) return false;
+      } while (eat(','));
+      break;
+    case kTraceSlice:
+      if (!id(a) || !eat(',') || !num(b) || !eat(',') || !num(n)) {
+        return false;
+      }
+      rec.nums.push_back(n);
+      rec.refs.push_back({a, b});
+      break;
+    case kTraceBlock:
+      if (!num(a) || !eat(',') || !num(b)) return false;
+      rec.nums.push_back(a);
+      rec.nums.push_back(b);
+      if (!eat(',') || !id(a) || !eat(',') || !id(b)) return false;
+      rec.refs.push_back({a, 0});
+      rec.refs.push_back({b, 0});
+      break;
+    case kTraceMalloc:
+      if (!num(a)) return false;
+      rec.nums.push_back(a);
+      while (eat(',')) {
+        if (!id(a)) return false;
+        rec.refs.push_back({a, 0});
+      }
+      break;
+    default:
+      return false;
+  }
+  return eat(')') && p == end;
+}
+
+#endif  // FSLICE_RUNTIME_TRACE_H_
@@ -0,0 +1,721 @@
+/* Copyright 2015 Peter Goodman (peter@trailofbits.com), all rights reserved. */
+
+// Builds the slice graph of a text or binary trace in one streaming pass, and
+// prints the DOT graph that `PrintBlocks` in `visualize/head.py` produces. It
+// can also write a summary of what the contents of each block depend on.
+//
+// Usage: fslice-analyze [-j threads] [-s summary.txt] [-n] [trace] > trace.dot
+//
+// `-j` sets the number of threads that compute the summaries, and `-n` skips
+// printing the DOT graph.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "runtime/Trace.h"
+#include "tools/TraceReader.h"
+
+enum : uint64_t {
+  kChunkShift = 16,
+  kChunkSize = 1ULL << kChunkShift,
+  kWholeNode = ~0ULL
+};
+
+// Append-only array that is allocated in fixed-size chunks, so that growing it
+// never copies or moves the existing elements. New elements are zeroed.
+template <typename T>
+class Pool {
+ public:
+  uint64_t Size(void) const {
+    return size;
+  }
+
+  T &operator[](uint64_t i) {
+    return chunks[i >> kChunkShift][i & (kChunkSize - 1)];
+  }
+
+  const T &operator[](uint64_t i) const {
+    return chunks[i >> kChunkShift][i & (kChunkSize - 1)];
+  }
+
+  uint64_t Add(const T &val) {
+    Resize(size + 1);
+    (*this)[size - 1] = val;
+    return size - 1;
+  }
+
+  void Resize(uint64_t new_size) {
+    while ((chunks.size() << kChunkShift) < new_size) {
+      chunks.emplace_back(new T[kChunkSize]());
+    }
+    size = std::max(size, new_size);
+  }
+
+ private:
+  std::vector<std::unique_ptr<T[]>> chunks;
+  uint64_t size = 0;
+};
+
+enum NodeKind : uint8_t {
+  kNodeUnknown,
+  kNodeValue,
+  kNodeOp,
+  kNodeObject,
+  kNodeSlice,
+  kNodeBlock,
+  kNodeName,
+  kNodeData,
+  kNodeMalloc
+};
+
+// A node of the slice graph. The meaning of `a` and `b` depends on the kind.
+//
+//    V     a = value
+//    A     op = opcode, a = left id, b = right id
+//    O     a = first byte in `Graph::bytes`, b = number of bytes
+//    S     a = source id, b = index of {offset, size} in `Graph::pairs`
+//    B     a = block number, b = index of {size id, nr id} in `Graph::pairs`
+//
+// `size` is the number of bytes that the node is drawn with, which grows to
+// cover every byte that is selected from it, just like `Base.size`.
+struct Node {
+  uint64_t kind:8;
+  uint64_t op:24;
+  uint64_t size:32;
+  uint64_t a;
+  uint64_t b;
+};
+
+// Reference to a byte of a node, or to the whole node.
+struct Ref {
+  uint64_t id;
+  uint64_t byte;
+};
+
+struct Pair {
+  uint64_t first;
+  uint64_t second;
+};
+
+// Assignment of `len` bytes of `dst`, starting at `dst_offset`.
+struct Assign {
+  uint64_t dst;
+  uint64_t dst_offset;
+  uint64_t src;
+  uint64_t src_offset;
+  uint64_t len;
+  uint64_t is_seq;
+};
+
+enum Port {
+  kPortByte,
+  kPortLeft,
+  kPortRight,
+  kPortSize,
+  kPortNr
+};
+
+// Slice graph with the same semantics as the classes in `visualize/head.py`.
+// Assignments are kept in trace order until `Finalize` groups them by their
+// destination into a CSR array.
+class Graph {
+ public:
+  Graph(void) {
+    nodes.Resize(1);
+    nodes[0] = {kNodeValue, 0, 1, 0, 0};  // `t0 = V(0x0)`.
+  }
+
+  void Add(const TraceRecord &rec) {
+    Node node = {kNodeUnknown, 0, 1, 0, 0};
+    switch (rec.tag) {
+      case kTraceOpNames:
+        return;
+      case kTraceValue:
+        node = {kNodeValue, 0, 1, rec.nums[0], 0};
+        break;
+      case kTraceOp:
+        Grow(rec.refs[0].id, 0);
+        Grow(rec.refs[1].id, 0);
+        node = {kNodeOp, rec.nums[0], 1, rec.refs[0].id, rec.refs[1].id};
+        break;
+      case kTraceObject:
+        node = {kNodeObject, 0, rec.refs.size(), bytes.Size(),
+                rec.refs.size()};
+        for (const auto &ref : rec.refs) {
+          bytes.Add(Select(ref.id, ref.offset));
+        }
+        break;
+      case kTraceSlice:
+        Grow(rec.refs[0].id, rec.refs[0].offset + rec.nums[0]);
+        node = {kNodeSlice, 0, rec.nums[0], rec.refs[0].id,
+                pairs.Add({rec.refs[0].offset, rec.nums[0]})};
+        break;
+      case kTraceBlock:
+        Grow(rec.refs[0].id, 0);
+        Grow(rec.refs[1].id, 0);
+        node = {kNodeBlock, 0, rec.nums[0], rec.nums[1],
+                pairs.Add({rec.refs[0].id, rec.refs[1].id})};
+        blocks.push_back(rec.id);
+        break;
+      case kTraceName:
+        node = {kNodeName, 0, rec.nums[0], 0, 0};
+        break;
+      case kTraceData:
+        node = {kNodeData, 0, rec.nums[0], 0, 0};
+        break;
+      case kTraceMalloc:
+        node = {kNodeMalloc, 0, rec.nums[0], 0, 0};
+        break;
+      case kTraceAssign: {
+        const auto len = rec.nums[0];
+        const auto is_seq = rec.nums[1];
+        Grow(rec.refs[1].id, rec.refs[1].offset + (is_seq ? len : 1));
+        Grow(rec.refs[0].id, 0);
+        assigns.Add({rec.refs[0].id, rec.refs[0].offset, rec.refs[1].id,
+                     rec.refs[1].offset, len, is_seq});
+        return;
+      }
+    }
+    Grow(rec.id, 0);
+    nodes[rec.id] = node;
+  }
+
+  // Group the assignments by their destination node. Assignments to the same
+  // node stay in trace order, so that later ones win.
+  void Finalize(void) {
+    first_assign.assign(nodes.Size() + 1, 0);
+    for (auto i = 0UL; i < assigns.Size(); ++i) {
+      ++first_assign[assigns[i].dst + 1];
+    }
+    for (auto i = 1UL; i < first_assign.size(); ++i) {
+      first_assign[i] += first_assign[i - 1];
+    }
+    sorted_assigns.Resize(assigns.Size());
+    for (auto i = 0UL; i < assigns.Size(); ++i) {
+      sorted_assigns[first_assign[assigns[i].dst]++] = assigns[i];
+    }
+    for (auto i = first_assign.size() - 1; i; --i) {
+      first_assign[i] = first_assign[i - 1];
+    }
+    first_assign[0] = 0;
+  }
+
+  uint64_t NumNodes(void) const {
+    return nodes.Size();
+  }
+
+  const Node &GetNode(uint64_t id) const {
+    return nodes[id];
+  }
+
+  const std::vector<uint64_t> &Blocks(void) const {
+    return blocks;
+  }
+
+  // Invoke `cb(port, index, ref)` on each outgoing edge of the node `id`.
+  // `scratch` holds the final source of each assigned byte.
+  template <typename CB>
+  void ForEachEdge(uint64_t id, std::vector<Ref> &scratch, CB cb) const {
+    const auto &node = nodes[id];
+    switch (node.kind) {
+      case kNodeOp:
+        if (kNodeValue != nodes[node.a].kind) {
+          cb(kPortLeft, 0, Ref{node.a, kWholeNode});
+        }
+        if (kNodeValue != nodes[node.b].kind) {
+          cb(kPortRight, 0, Ref{node.b, kWholeNode});
+        }
+        break;
+      case kNodeObject:
+        for (auto i = 0UL; i < node.b; ++i) {
+          cb(kPortByte, i, bytes[node.a + i]);
+        }
+        break;
+      case kNodeSlice: {
+        const auto &slice = pairs[node.b];
+        for (auto i = 0UL; i < slice.second; ++i) {
+          cb(kPortByte, i, Resolve(node.a, slice.first + i));
+        }
+        break;
+      }
+      case kNodeBlock: {
+        const auto &deps = pairs[node.b];
+        if (kNodeValue != nodes[deps.first].kind) {
+          cb(kPortSize, 0, Ref{deps.first, kWholeNode});
+        }
+        if (kNodeValue != nodes[deps.second].kind) {
+          cb(kPortNr, 0, Ref{deps.second, kWholeNode});
+        }
+        break;
+      }
+      default:
+        break;
+    }
+
+    const auto begin = first_assign[id];
+    const auto end = first_assign[id + 1];
+    if (begin == end) return;
+    scratch.clear();
+    for (auto i = begin; i < end; ++i) {
+      const auto &assign = sorted_assigns[i];
+      const auto last = assign.dst_offset + assign.len;
+      if (scratch.size() < last) scratch.resize(last, Ref{0, kWholeNode});
+      for (auto j = 0UL; j < assign.len; ++j) {
+        scratch[assign.dst_offset + j] = {
+            assign.src, assign.src_offset + (assign.is_seq ? j : 0)};
+      }
+    }
+    for (auto i = 0UL; i < scratch.size(); ++i) {
+      if (kWholeNode != scratch[i].byte) {
+        cb(kPortByte, i, Resolve(scratch[i].id, scratch[i].byte));
+      }
+    }
+  }
+
+ private:
+  // Make sure that the node `id` exists, and is drawn with at least `size`
+  // bytes.
+  void Grow(uint64_t id, uint64_t size) {
+    if (id >= nodes.Size()) nodes.Resize(id + 1);
+    auto &node = nodes[id];
+    if (node.size < size) node.size = size;
+  }
+
+  // Equivalent of `node[byte]`.
+  Ref Select(uint64_t id, uint64_t byte) {
+    Grow(id, byte + 1);
+    return Resolve(id, byte);
+  }
+
+  // Find the byte that `id[byte]` refers to. Objects and slices forward
+  // their bytes to the bytes they were made from.
+  Ref Resolve(uint64_t id, uint64_t byte) const {
+    for (;;) {
+      const auto &node = nodes[id];
+      if (kNodeObject == node.kind && byte < node.b) {
+        return bytes[node.a + byte];
+      } else if (kNodeSlice == node.kind && byte < pairs[node.b].second) {
+        byte += pairs[node.b].first;
+        id = node.a;
+      } else {
+        return {id, byte};
+      }
+    }
+  }
+
+  Pool<Node> nodes;
+  Pool<Ref> bytes;
+  Pool<Pair> pairs;
+  Pool<Assign> assigns;
+  Pool<Assign> sorted_assigns;
+  std::vector<uint64_t> first_assign;
+  std::vector<uint64_t> blocks;
+};
+
+// Buffered writer for the DOT output.
+class Output {
+ public:
+  explicit Output(FILE *file_)
+      : file(file_) {}
+
+  ~Output(void) {
+    Flush();
+  }
+
+  Output &operator<<(const char *str) {
+    buf.append(str);
+    if (kTraceReadSize <= buf.size()) Flush();
+    return *this;
+  }
+
+  Output &operator<<(uint64_t val) {
+    char num[24];
+    auto i = sizeof num;
+    do {
+      num[--i] = static_cast<char>('0' + (val % 10));
+      val /= 10;
+    } while (val);
+    buf.append(&(num[i]), sizeof num - i);
+    if (kTraceReadSize <= buf.size()) Flush();
+    return *this;
+  }
+
+  void Flush(void) {
+    fwrite(buf.data(), 1, buf.size(), file);
+    buf.clear();
+  }
+
+ private:
+  FILE *file;
+  std::string buf;
+};
+
+static void PrintLabel(Output &out, Ref ref) {
+  out << "n" << ref.id;
+  if (kWholeNode != ref.byte) out << ":b" << ref.byte;
+}
+
+static void PrintBytes(Output &out, const Node &node) {
+  for (auto i = 0UL; i < node.size; ++i) {
+    out << (i ? "|<b" : "<b") << i << ">";
+  }
+}
+
+static void PrintNode(Output &out, const Graph &graph,
+                      const std::vector<std::string> &op_names, uint64_t id) {
+  const auto &node = graph.GetNode(id);
+  auto operand = [&] (uint64_t oid, const char *port) {
+    const auto &operand = graph.GetNode(oid);
+    if (kNodeValue == operand.kind) {
+      out << operand.a;
+    } else {
+      out << port;
+    }
+  };
+  char hex[24];
+  out << "n" << id;
+  switch (node.kind) {
+    case kNodeValue:
+      snprintf(hex, sizeof hex, "0x%llx", static_cast<unsigned long long>(node.a));
+      out << " [label=\"{{";
+      PrintBytes(out, node);
+      out << "}|" << hex << "}\"];\n";
+      break;
+    case kNodeOp:
+      out << " [color=blue label=\"{ { ";
+      PrintBytes(out, node);
+      out << " } |";
+      out << (node.op < op_names.size() ? op_names[node.op].c_str() : "?");
+      out << "| {";
+      operand(node.a, "<left>");
+      out << "|";
+      operand(node.b, "<right>");
+      out << "} }\"];\n";
+      break;
+    case kNodeObject:
+    case kNodeSlice:
+      out << " [label=\"{{}|{";
+      PrintBytes(out, node);
+      out << "}}\"];\n";
+      break;
+    case kNodeBlock:
+      out << " [rank=max fillcolor=grey style=filled label=\"{{";
+      PrintBytes(out, node);
+      out << "}|{<size>size = " << node.size << "|<nr>nr = " << node.a
+          << " }}\"];\n";
+      break;
+    case kNodeName:
+      out << " [fillcolor=green style=filled label=\"";
+      PrintBytes(out, node);
+      out << "\"];\n";
+      break;
+    case kNodeData:
+      out << " [fillcolor=orange style=filled label=\"";
+      PrintBytes(out, node);
+      out << "\"];\n";
+      break;
+    case kNodeMalloc:
+      out << " [fillcolor=blue style=filled label=\"";
+      PrintBytes(out, node);
+      out << "\"];\n";
+      break;
+    default:
+      out << " [label=\"";
+      PrintBytes(out, node);
+      out << "\"];\n";
+      break;
+  }
+}
+
+static const char *kPortNames[] = {"b", "left", "right", "size", "nr"};
+
+// Print the nodes reachable from the blocks, and the edges between them. The
+// versions of a block with more than one version are grouped into a cluster.
+// Edges are spilled to a temporary file, and printed after all nodes.
+static void PrintDot(const Graph &graph,
+                     const std::vector<std::string> &op_names) {
+  auto edges_file = tmpfile();
+  if (!edges_file) {
+    std::cerr << "Unable to create a temporary file." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  Output out(stdout);
+  Output edges(edges_file);
+  std::vector<bool> seen(graph.NumNodes());
+  std::deque<uint64_t> next;
+  std::vector<Ref> scratch;
+
+  auto visit = [&] (uint64_t id) {
+    PrintNode(out, graph, op_names, id);
+    graph.ForEachEdge(id, scratch, [&] (Port port, uint64_t i, Ref ref) {
+      edges << "n" << id << ":" << kPortNames[port];
+      if (kPortByte == port) edges << i;
+      edges << " -> ";
+      PrintLabel(edges, ref);
+      edges << ";\n";
+      if (!seen[ref.id]) {
+        seen[ref.id] = true;
+        next.push_back(ref.id);
+      }
+    });
+  };
+
+  std::map<uint64_t, std::vector<uint64_t>> blocks;
+  for (auto id : graph.Blocks()) {
+    blocks[graph.GetNode(id).a].push_back(id);
+    seen[id] = true;
+  }
+
+  out << "digraph {\nnode [shape=record];\n";
+  for (const auto &nr_ids : blocks) {
+    const auto is_cluster = 1 < nr_ids.second.size();
+    if (is_cluster) {
+      out << "subgraph cluster" << nr_ids.first << " {\nrankdir=TB;\n";
+    }
+    for (auto id : nr_ids.second) visit(id);
+    if (is_cluster) out << "}\n";
+  }
+  while (!next.empty()) {
+    const auto id = next.front();
+    next.pop_front();
+    visit(id);
+  }
+  out.Flush();
+
+  edges.Flush();
+  rewind(edges_file);
+  char buf[1 << 16];
+  for (size_t n; (n = fread(buf, 1, sizeof buf, edges_file)); ) {
+    fwrite(buf, 1, n, stdout);
+  }
+  fclose(edges_file);
+  fputs("}\n", stdout);
+}
+
+// Work-stealing queues of work items. Each worker owns a queue that starts
+// out with a contiguous share of the items. A worker takes items from the
+// back of its own queue, and once that runs dry it steals from the front of
+// the other workers' queues.
+class WorkQueues {
+ public:
+  WorkQueues(unsigned num_workers, uint64_t num_items) {
+    for (auto w = 0U; w < num_workers; ++w) {
+      queues.emplace_back(new Queue);
+      const auto begin = num_items * w / num_workers;
+      const auto end = num_items * (w + 1) / num_workers;
+      for (auto i = begin; i < end; ++i) queues.back()->items.push_back(i);
+    }
+  }
+
+  bool Pop(unsigned worker, uint64_t &item) {
+    auto &own = *queues[worker];
+    {
+      std::lock_guard<std::mutex> locker(own.lock);
+      if (!own.items.empty()) {
+        item = own.items.back();
+        own.items.pop_back();
+        return true;
+      }
+    }
+    for (auto i = 1UL; i < queues.size(); ++i) {
+      auto &other = *queues[(worker + i) % queues.size()];
+      std::lock_guard<std::mutex> locker(other.lock);
+      if (!other.items.empty()) {
+        item = other.items.front();
+        other.items.pop_front();
+        return true;
+      }
+    }
+    return false;
+  }
+
+ private:
+  struct Queue {
+    std::mutex lock;
+    std::deque<uint64_t> items;
+  };
+
+  std::vector<std::unique_ptr<Queue>> queues;
+};
+
+// What the versions of one block are reachable from.
+struct Summary {
+  uint64_t num_nodes;
+  std::vector<uint64_t> blocks;
+  std::vector<uint64_t> names;
+  std::vector<uint64_t> data;
+};
+
+// Per-worker state for computing summaries. `visited` marks the nodes that
+// have been reached while summarizing the current block, i.e. the ones whose
+// mark equals `epoch`.
+struct Summarizer {
+  explicit Summarizer(uint64_t num_nodes)
+      : visited(num_nodes),
+        epoch(0) {}
+
+  void Summarize(const Graph &graph, uint64_t nr,
+                 const std::vector<uint64_t> &ids, Summary &summary) {
+    ++epoch;
+    work.clear();
+    for (auto id : ids) {
+      visited[id] = epoch;
+      work.push_back(id);
+    }
+    summary.num_nodes = 0;
+    while (!work.empty()) {
+      const auto id = work.back();
+      work.pop_back();
+      ++summary.num_nodes;
+      const auto &node = graph.GetNode(id);
+      if (kNodeBlock == node.kind && node.a != nr) {
+        summary.blocks.push_back(node.a);
+      } else if (kNodeName == node.kind) {
+        summary.names.push_back(id);
+      } else if (kNodeData == node.kind) {
+        summary.data.push_back(id);
+      }
+      graph.ForEachEdge(id, scratch, [&] (Port, uint64_t, Ref ref) {
+        if (epoch != visited[ref.id]) {
+          visited[ref.id] = epoch;
+          work.push_back(ref.id);
+        }
+      });
+    }
+    std::sort(summary.blocks.begin(), summary.blocks.end());
+    summary.blocks.erase(
+        std::unique(summary.blocks.begin(), summary.blocks.end()),
+        summary.blocks.end());
+    std::sort(summary.names.begin(), summary.names.end());
+    std::sort(summary.data.begin(), summary.data.end());
+  }
+
+  std::vector<uint32_t> visited;
+  uint32_t epoch;
+  std::vector<uint64_t> work;
+  std::vector<Ref> scratch;
+};
+
+// Write one line per block number, listing the other blocks, names and data
+// that the versions of that block are reachable from. The blocks are
+// summarized by `num_threads` threads, which share the read-only graph. The
+// output doesn't depend on the number of threads.
+static void PrintSummaries(const Graph &graph, FILE *file,
+                           unsigned num_threads) {
+  std::map<uint64_t, std::vector<uint64_t>> nr_ids;
+  for (auto id : graph.Blocks()) {
+    nr_ids[graph.GetNode(id).a].push_back(id);
+  }
+  const std::vector<std::pair<uint64_t, std::vector<uint64_t>>> blocks(
+      nr_ids.begin(), nr_ids.end());
+  std::vector<Summary> summaries(blocks.size());
+
+  const auto start = std::chrono::steady_clock::now();
+  WorkQueues queues(num_threads, blocks.size());
+  std::vector<std::thread> threads;
+  for (auto w = 0U; w < num_threads; ++w) {
+    threads.emplace_back([&, w] (void) {
+      Summarizer summarizer(graph.NumNodes());
+      for (uint64_t i = 0; queues.Pop(w, i); ) {
+        summarizer.Summarize(graph, blocks[i].first, blocks[i].second,
+                             summaries[i]);
+      }
+    });
+  }
+  for (auto &thread : threads) thread.join();
+  const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  std::cerr << "Summarized " << blocks.size() << " blocks in "
+            << elapsed.count() << " ms with " << num_threads << " threads."
+            << std::endl;
+
+  Output out(file);
+  auto list = [&] (const std::vector<uint64_t> &nums, const char *prefix) {
+    auto sep = "";
+    for (auto num : nums) {
+      out << sep << prefix << num;
+      sep = ",";
+    }
+  };
+  for (auto i = 0UL; i < blocks.size(); ++i) {
+    const auto &summary = summaries[i];
+    out << "block " << blocks[i].first << ": versions="
+        << static_cast<uint64_t>(blocks[i].second.size())
+        << " nodes=" << summary.num_nodes << " blocks=";
+    list(summary.blocks, "");
+    out << " names=";
+    list(summary.names, "t");
+    out << " data=";
+    list(summary.data, "t");
+    out << "\n";
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const char *summary_path = nullptr;
+  const char *trace_path = nullptr;
+  auto num_threads = std::max(1U, std::thread::hardware_concurrency());
+  auto print_dot = true;
+  for (auto i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      summary_path = argv[++i];
+    } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+      num_threads = std::max(1U, static_cast<unsigned>(atoi(argv[++i])));
+    } else if (!strcmp(argv[i], "-n")) {
+      print_dot = false;
+    } else if (!trace_path) {
+      trace_path = argv[i];
+    } else {
+      std::cerr << "Usage: " << argv[0]
+                << " [-j threads] [-s summary.txt] [-n] [trace]" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  auto in = stdin;
+  if (trace_path && strcmp(trace_path, "-")) {
+    in = fopen(trace_path, "rb");
+    if (!in) {
+      std::cerr << "Unable to open " << trace_path << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  Graph graph;
+  std::vector<std::string> op_names;
+  auto is_binary = false;
+  if (!ReadTrace(in, is_binary, op_names,
+                 [&] (const TraceRecord &rec, uint64_t) {
+                   graph.Add(rec);
+                   return true;
+                 })) {
+    return EXIT_FAILURE;
+  }
+
+  graph.Finalize();
+  if (print_dot) PrintDot(graph, op_names);
+
+  if (summary_path) {
+    auto summary = fopen(summary_path, "w");
+    if (!summary) {
+      std::cerr << "Unable to open " << summary_path << std::endl;
+      return EXIT_FAILURE;
+    }
+    PrintSummaries(graph, summary, num_threads);
+    fclose(summary);
+  }
+  return EXIT_SUCCESS;
+}
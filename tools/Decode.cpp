@@ -0,0 +1,78 @@
+/* Copyright 2015 Peter Goodman (peter@trailofbits.com), all rights reserved. */
+
+// Converts a binary trace into the Python statements that `visualize.sh`
+// expects.
+//
+// Usage: fslice-decode [trace.bin] > trace.py
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "runtime/Trace.h"
+
+enum : uint64_t {
+  kReadSize = 1ULL << 20
+};
+
+int main(int argc, char *argv[]) {
+  auto in = stdin;
+  if (2 <= argc && strcmp(argv[1], "-")) {
+    in = fopen(argv[1], "rb");
+    if (!in) {
+      std::cerr << "Unable to open " << argv[1] << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  char magic[kTraceMagicSize];
+  if (kTraceMagicSize != fread(magic, 1, kTraceMagicSize, in) ||
+      memcmp(magic, kTraceMagic, kTraceMagicSize)) {
+    std::cerr << "Input is not a binary FSlice trace." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<uint8_t> buf;
+  std::string out;
+  std::vector<std::string> op_names;
+  TraceRecord rec;
+  auto offset = 0UL;
+  auto eof = false;
+
+  while (!eof || offset < buf.size()) {
+    // Refill the buffer, keeping any partially decoded record at the front.
+    if (!eof) {
+      buf.erase(buf.begin(), buf.begin() + offset);
+      offset = 0;
+      const auto old_size = buf.size();
+      buf.resize(old_size + kReadSize);
+      const auto got = fread(&(buf[old_size]), 1, kReadSize, in);
+      buf.resize(old_size + got);
+      eof = !got;
+    }
+
+    const uint8_t *begin = buf.data();
+    const auto end = begin + buf.size();
+    auto p = begin + offset;
+    while (p < end) {
+      auto next = p;
+      if (!DecodeRecord(next, end, rec)) break;
+      if (kTraceOpNames == rec.tag) op_names = rec.names;
+      FormatRecord(rec, op_names, out);
+      p = next;
+    }
+    offset = static_cast<uint64_t>(p - begin);
+
+    fwrite(out.data(), 1, out.size(), stdout);
+    out.clear();
+
+    if (eof && offset < buf.size()) {
+      std::cerr << "Trace is truncated or corrupted." << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
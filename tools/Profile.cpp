@@ -0,0 +1,155 @@
+/* Copyright 2015 Peter Goodman (peter@trailofbits.com), all rights reserved. */
+
+// Ranks source lines by the cost of the hooks that instrument them, using the
+// profile that the runtime writes to `FSLICE_PROFILE` when the file system is
+// compiled with `-fslice-profile-sites`.
+//
+// Usage: fslice-profile [-f] [-n count] [profile.txt]
+//
+// `-f` ranks functions instead of source lines, and `-n` sets how many are
+// printed (zero prints all of them).
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// The cost of the hooks of one source line or function.
+struct Cost {
+  std::string name;
+  double cycles;
+  uint64_t calls;
+  uint64_t num_sites;
+  std::set<std::string> hooks;
+  std::set<std::string> functions;
+};
+
+// Split `line` into its tab-separated fields.
+static std::vector<std::string> SplitFields(const std::string &line) {
+  std::vector<std::string> fields;
+  std::string::size_type begin = 0;
+  for (;;) {
+    const auto end = line.find('\t', begin);
+    fields.push_back(line.substr(begin, end - begin));
+    if (std::string::npos == end) break;
+    begin = end + 1;
+  }
+  return fields;
+}
+
+// Remove the column from a `file:line:column` source location.
+static std::string SourceLine(const std::string &loc) {
+  const auto colon = loc.rfind(':');
+  if (std::string::npos == colon || !colon) return loc;
+  if (std::string::npos == loc.rfind(':', colon - 1)) return loc;
+  return loc.substr(0, colon);
+}
+
+static std::string Join(const std::set<std::string> &names) {
+  std::string joined;
+  for (const auto &name : names) {
+    if (!joined.empty()) joined.append(",");
+    joined.append(name);
+  }
+  return joined;
+}
+
+int main(int argc, char *argv[]) {
+  const char *profile_path = nullptr;
+  auto by_function = false;
+  auto max_rows = 20UL;
+  for (auto i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-f")) {
+      by_function = true;
+    } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      max_rows = strtoul(argv[++i], nullptr, 10);
+    } else if (!profile_path) {
+      profile_path = argv[i];
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [-f] [-n count] [profile.txt]"
+                << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  auto in = stdin;
+  if (profile_path && strcmp(profile_path, "-")) {
+    in = fopen(profile_path, "r");
+    if (!in) {
+      std::cerr << "Unable to open " << profile_path << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Each site's cycles are estimated from its timed calls. Sites that were
+  // never timed are still ranked by their number of calls.
+  std::map<std::string, Cost> costs;
+  double total_cycles = 0;
+  uint64_t total_calls = 0;
+  std::string line;
+  auto line_num = 0UL;
+  char buf[4096];
+  while (fgets(buf, sizeof buf, in)) {
+    line.append(buf);
+    if ('\n' != line.back() && !feof(in)) continue;
+    if ('\n' == line.back()) line.pop_back();
+    ++line_num;
+    if (line.empty()) continue;
+
+    const auto fields = SplitFields(line);
+    line.clear();
+    if (8 != fields.size()) {
+      std::cerr << "Malformed site on line " << line_num << std::endl;
+      return EXIT_FAILURE;
+    }
+    const auto calls = strtoull(fields[1].c_str(), nullptr, 10);
+    const auto samples = strtoull(fields[2].c_str(), nullptr, 10);
+    const auto cycles = strtoull(fields[3].c_str(), nullptr, 10);
+    const auto &hook = fields[4];
+    const auto &function = fields[5];
+    const auto &loc = fields[7];
+
+    const auto name = by_function ? function : SourceLine(loc);
+    auto &cost = costs[name];
+    cost.name = name;
+    if (samples) {
+      const auto site_cycles = double(cycles) * calls / samples;
+      cost.cycles += site_cycles;
+      total_cycles += site_cycles;
+    }
+    cost.calls += calls;
+    cost.num_sites += 1;
+    cost.hooks.insert(hook);
+    cost.functions.insert(function);
+    total_calls += calls;
+  }
+
+  std::vector<const Cost *> ranked;
+  for (const auto &entry : costs) ranked.push_back(&(entry.second));
+  std::sort(ranked.begin(), ranked.end(),
+            [] (const Cost *a, const Cost *b) {
+              if (a->cycles != b->cycles) return a->cycles > b->cycles;
+              return a->calls > b->calls;
+            });
+  if (max_rows && ranked.size() > max_rows) ranked.resize(max_rows);
+
+  printf("%16s %7s %14s %6s  %s\n", "cycles", "%", "calls", "sites",
+         by_function ? "function" : "line");
+  for (auto cost : ranked) {
+    printf("%16.0f %6.2f%% %14" PRIu64 " %6" PRIu64 "  %s  [%s]",
+           cost->cycles,
+           total_cycles ? 100.0 * cost->cycles / total_cycles : 0.0,
+           cost->calls, cost->num_sites, cost->name.c_str(),
+           Join(cost->hooks).c_str());
+    if (!by_function) printf(" in %s", Join(cost->functions).c_str());
+    printf("\n");
+  }
+  printf("%16.0f %7s %14" PRIu64 "  total\n", total_cycles, "", total_calls);
+  return EXIT_SUCCESS;
+}
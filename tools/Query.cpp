@@ -0,0 +1,484 @@
+/* Copyright 2015 Peter Goodman (peter@trailofbits.com), all rights reserved. */
+
+// Answers slice queries about one block, byte range or node of a trace
+// without rendering the whole graph. `index` reads the trace once and writes
+// `trace.idx` next to it. `backward` and `forward` memory-map the trace and
+// its index, and print the records of the slice, in trace order, as a text
+// trace that `fslice-analyze` can draw.
+//
+// Usage: fslice-query index trace
+//        fslice-query backward trace target > slice.py
+//        fslice-query forward trace target > slice.py
+//
+// A target is a node (`t12`), a block number (`b7`, meaning every version of
+// that block), or either one restricted to a byte range (`t12[0:8]`,
+// `b7[512:1024]`). The byte range only filters the first step of the slice.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "runtime/Trace.h"
+#include "tools/TraceReader.h"
+
+enum : uint64_t {
+  kIndexMagicSize = 8,
+  kNoRecord = ~0ULL
+};
+
+static const char kIndexMagic[kIndexMagicSize] = {
+    'F', 'S', 'L', 'I', 'D', 'X', '\0', 2};
+
+// Layout of an index file. The header is followed by these arrays of
+// `uint64_t`s, each of which is indexed by node id:
+//
+//    defs          offset of the record that defines the node
+//    assign_begin  CSR offsets into `assigns`, num_ids + 1 entries
+//    assigns       offsets of the `=` records that assign to the node
+//    use_begin     CSR offsets into `uses`, num_ids + 1 entries
+//    uses          offsets of the records that read from the node
+//
+// then `num_blocks` {block number, node id} pairs, sorted, and finally the
+// offsets of the `num_op_names` `P` records of a binary trace. Later `P`
+// records extend the earlier ones with the opcodes of summaries that were
+// registered after the trace started.
+struct IndexHeader {
+  char magic[kIndexMagicSize];
+  uint64_t trace_size;
+  uint64_t is_binary;
+  uint64_t num_ids;
+  uint64_t num_assigns;
+  uint64_t num_uses;
+  uint64_t num_blocks;
+  uint64_t num_op_names;
+};
+
+// Returns `true` if `size` bytes is the size of an index with `header`, i.e.
+// if the arrays that the header describes fit the index exactly.
+static bool IsIndexSize(const IndexHeader &header, uint64_t size) {
+  const auto max_num = size / sizeof(uint64_t);
+  if (header.num_ids >= max_num || header.num_assigns > max_num ||
+      header.num_uses > max_num || header.num_blocks > max_num ||
+      header.num_op_names > max_num) {
+    return false;
+  }
+  const auto num_words = 3 * header.num_ids + 2 + header.num_assigns +
+                         header.num_uses + 2 * header.num_blocks +
+                         header.num_op_names;
+  return sizeof(IndexHeader) + num_words * sizeof(uint64_t) == size;
+}
+
+// A read-only file mapped into memory.
+class MappedFile {
+ public:
+  ~MappedFile(void) {
+    if (data) munmap(const_cast<uint8_t *>(data), size);
+  }
+
+  bool Open(const std::string &path) {
+    const auto fd = open(path.c_str(), O_RDONLY);
+    if (-1 == fd) return false;
+    struct stat info;
+    if (fstat(fd, &info) || !info.st_size) {
+      close(fd);
+      return false;
+    }
+    size = static_cast<uint64_t>(info.st_size);
+    auto addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == addr) return false;
+    data = static_cast<const uint8_t *>(addr);
+    return true;
+  }
+
+  const uint8_t *data = nullptr;
+  uint64_t size = 0;
+};
+
+// Convert `pairs` of {id, offset} into CSR form, keeping the offsets of each
+// id in trace order.
+static void BuildCSR(std::vector<std::pair<uint64_t, uint64_t>> &pairs,
+                     uint64_t num_ids, std::vector<uint64_t> &begin,
+                     std::vector<uint64_t> &offsets) {
+  begin.assign(num_ids + 1, 0);
+  for (const auto &p : pairs) ++begin[p.first + 1];
+  for (auto i = 1UL; i <= num_ids; ++i) begin[i] += begin[i - 1];
+  offsets.resize(pairs.size());
+  auto next = begin;
+  for (const auto &p : pairs) offsets[next[p.first]++] = p.second;
+  pairs.clear();
+  pairs.shrink_to_fit();
+}
+
+static int Index(const std::string &trace_path) {
+  auto in = fopen(trace_path.c_str(), "rb");
+  if (!in) {
+    std::cerr << "Unable to open " << trace_path << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<uint64_t> defs;
+  std::vector<std::pair<uint64_t, uint64_t>> assigns;
+  std::vector<std::pair<uint64_t, uint64_t>> uses;
+  std::vector<std::pair<uint64_t, uint64_t>> blocks;
+  std::vector<uint64_t> op_name_offsets;
+  std::vector<std::string> op_names;
+  auto is_binary = false;
+  auto num_ids = 1UL;
+
+  auto add_use = [&] (uint64_t id, uint64_t offset) {
+    num_ids = std::max(num_ids, id + 1);
+    if (uses.empty() || uses.back() != std::make_pair(id, offset)) {
+      uses.push_back({id, offset});
+    }
+  };
+
+  auto ok = ReadTrace(in, is_binary, op_names,
+                      [&] (const TraceRecord &rec, uint64_t offset) {
+    if (kTraceOpNames == rec.tag) {
+      op_name_offsets.push_back(offset);
+      return true;
+    }
+    if (kTraceAssign == rec.tag) {
+      num_ids = std::max(num_ids, rec.refs[0].id + 1);
+      assigns.push_back({rec.refs[0].id, offset});
+      add_use(rec.refs[1].id, offset);
+      return true;
+    }
+    num_ids = std::max(num_ids, rec.id + 1);
+    if (defs.size() <= rec.id) defs.resize(rec.id + 1, kNoRecord);
+    defs[rec.id] = offset;
+    if (kTraceBlock == rec.tag) blocks.push_back({rec.nums[1], rec.id});
+    for (const auto &ref : rec.refs) add_use(ref.id, offset);
+    return true;
+  });
+  fclose(in);
+  if (!ok) return EXIT_FAILURE;
+
+  struct stat info;
+  if (stat(trace_path.c_str(), &info)) {
+    std::cerr << "Unable to stat " << trace_path << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  IndexHeader header;
+  memcpy(header.magic, kIndexMagic, kIndexMagicSize);
+  header.trace_size = static_cast<uint64_t>(info.st_size);
+  header.is_binary = is_binary;
+  header.num_ids = num_ids;
+  header.num_assigns = assigns.size();
+  header.num_uses = uses.size();
+  header.num_blocks = blocks.size();
+  header.num_op_names = op_name_offsets.size();
+
+  defs.resize(num_ids, kNoRecord);
+  std::vector<uint64_t> assign_begin, assign_offsets;
+  std::vector<uint64_t> use_begin, use_offsets;
+  BuildCSR(assigns, num_ids, assign_begin, assign_offsets);
+  BuildCSR(uses, num_ids, use_begin, use_offsets);
+  std::sort(blocks.begin(), blocks.end());
+
+  const auto index_path = trace_path + ".idx";
+  auto out = fopen(index_path.c_str(), "wb");
+  if (!out) {
+    std::cerr << "Unable to open " << index_path << std::endl;
+    return EXIT_FAILURE;
+  }
+  auto write = [&] (const std::vector<uint64_t> &vec) {
+    fwrite(vec.data(), sizeof(uint64_t), vec.size(), out);
+  };
+  fwrite(&header, sizeof header, 1, out);
+  write(defs);
+  write(assign_begin);
+  write(assign_offsets);
+  write(use_begin);
+  write(use_offsets);
+  for (const auto &block : blocks) {
+    const uint64_t pair[2] = {block.first, block.second};
+    fwrite(pair, sizeof pair, 1, out);
+  }
+  write(op_name_offsets);
+  if (fclose(out)) {
+    std::cerr << "Unable to write " << index_path << std::endl;
+    return EXIT_FAILURE;
+  }
+  std::cerr << "Indexed " << num_ids << " nodes, " << header.num_assigns
+            << " assignments and " << header.num_blocks << " blocks."
+            << std::endl;
+  return EXIT_SUCCESS;
+}
+
+// Node (or set of nodes) to slice from, and the bytes of it to start from.
+struct Target {
+  bool is_block;
+  uint64_t num;
+  uint64_t begin;
+  uint64_t end;
+};
+
+static bool ParseTarget(const char *str, Target &target) {
+  target = {false, 0, 0, ~0ULL};
+  if ('b' == str[0]) {
+    target.is_block = true;
+  } else if ('t' != str[0]) {
+    return false;
+  }
+  char *end = nullptr;
+  target.num = strtoull(str + 1, &end, 10);
+  if (end == str + 1) return false;
+  if (!*end) return true;
+  if ('[' != *end) return false;
+  auto p = end + 1;
+  target.begin = strtoull(p, &end, 10);
+  if (end == p || ':' != *end) return false;
+  p = end + 1;
+  target.end = strtoull(p, &end, 10);
+  return end != p && !strcmp(end, "]") && target.begin < target.end;
+}
+
+// Slices the trace through its index.
+class Slicer {
+ public:
+  Slicer(const MappedFile &trace_, const MappedFile &index_)
+      : trace(trace_),
+        header(reinterpret_cast<const IndexHeader *>(index_.data)) {
+    auto arr = reinterpret_cast<const uint64_t *>(header + 1);
+    defs = arr;
+    assign_begin = defs + header->num_ids;
+    assigns = assign_begin + header->num_ids + 1;
+    use_begin = assigns + header->num_assigns;
+    uses = use_begin + header->num_ids + 1;
+    blocks = uses + header->num_uses;
+    op_name_offsets = blocks + header->num_blocks * 2;
+    seen.resize(header->num_ids);
+
+    // Binary traces name the opcodes of `A` records up front, and add the
+    // opcodes of late summaries in later `P` records.
+    for (auto i = 0UL; header->is_binary && i < header->num_op_names; ++i) {
+      if (!ReadRecordAt(trace.data, trace.size, op_name_offsets[i], true,
+                        op_names, rec) || kTraceOpNames != rec.tag) {
+        continue;
+      }
+      for (auto j = op_names.size(); j < rec.names.size(); ++j) {
+        op_names.push_back(rec.names[j]);
+      }
+    }
+  }
+
+  // Add the ids of the nodes named by `target` to the work list.
+  bool Start(const Target &target) {
+    if (!target.is_block) {
+      if (target.num >= header->num_ids) return false;
+      Push(target.num, target.begin, target.end);
+      return true;
+    }
+    auto lo = 0UL, hi = header->num_blocks;
+    while (lo < hi) {
+      const auto mid = lo + (hi - lo) / 2;
+      if (blocks[mid * 2] < target.num) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    const auto first = lo;
+    for (; lo < header->num_blocks && blocks[lo * 2] == target.num; ++lo) {
+      Push(blocks[lo * 2 + 1], target.begin, target.end);
+    }
+    return lo != first;
+  }
+
+  // Collect the records that the work list transitively depends on.
+  void Backward(void) {
+    while (!work.empty()) {
+      const auto item = work.back();
+      work.pop_back();
+      AddDef(item.id);
+      if (Read(defs[item.id])) {
+        for (auto i = 0UL; i < rec.refs.size(); ++i) {
+          if (kTraceObject == rec.tag && (i < item.begin || i >= item.end)) {
+            continue;
+          }
+          Push(rec.refs[i].id, 0, ~0ULL);
+        }
+      }
+      for (auto i = assign_begin[item.id]; i < assign_begin[item.id + 1];
+           ++i) {
+        if (!Read(assigns[i])) continue;
+        const auto dst_begin = rec.refs[0].offset;
+        if (dst_begin >= item.end || dst_begin + rec.nums[0] <= item.begin) {
+          continue;
+        }
+        records.push_back(assigns[i]);
+        Push(rec.refs[1].id, 0, ~0ULL);
+      }
+    }
+  }
+
+  // Collect the records that transitively depend on the work list.
+  void Forward(void) {
+    while (!work.empty()) {
+      const auto item = work.back();
+      work.pop_back();
+      AddDef(item.id);
+      for (auto i = use_begin[item.id]; i < use_begin[item.id + 1]; ++i) {
+        if (!Read(uses[i]) || !ReadsFrom(item)) continue;
+        if (kTraceAssign == rec.tag) {
+          records.push_back(uses[i]);
+          Push(rec.refs[0].id, 0, ~0ULL);
+        } else {
+          Push(rec.id, 0, ~0ULL);
+        }
+      }
+    }
+  }
+
+  // Print the collected records in trace order.
+  void Print(void) {
+    std::sort(records.begin(), records.end());
+    records.erase(std::unique(records.begin(), records.end()), records.end());
+    std::string out;
+    for (auto offset : records) {
+      if (!Read(offset)) continue;
+      FormatRecord(rec, op_names, out);
+      if (kTraceReadSize <= out.size()) {
+        fwrite(out.data(), 1, out.size(), stdout);
+        out.clear();
+      }
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    std::cerr << records.size() << " records in the slice." << std::endl;
+  }
+
+ private:
+  struct WorkItem {
+    uint64_t id;
+    uint64_t begin;
+    uint64_t end;
+  };
+
+  void Push(uint64_t id, uint64_t begin, uint64_t end) {
+    if (id >= header->num_ids || seen[id]) return;
+    seen[id] = true;
+    work.push_back({id, begin, end});
+  }
+
+  void AddDef(uint64_t id) {
+    if (kNoRecord != defs[id]) records.push_back(defs[id]);
+  }
+
+  bool Read(uint64_t offset) {
+    return kNoRecord != offset &&
+           ReadRecordAt(trace.data, trace.size, offset, header->is_binary,
+                        op_names, rec);
+  }
+
+  // Returns true if the current record reads from the bytes of `item`.
+  bool ReadsFrom(const WorkItem &item) const {
+    for (auto i = 0UL; i < rec.refs.size(); ++i) {
+      const auto &ref = rec.refs[i];
+      if (ref.id != item.id) continue;
+      switch (rec.tag) {
+        case kTraceAssign:
+          if (1 != i) continue;
+          if (rec.nums[1]) {
+            if (ref.offset < item.end &&
+                item.begin < ref.offset + rec.nums[0]) return true;
+            continue;
+          }
+          if (ref.offset >= item.begin && ref.offset < item.end) return true;
+          continue;
+        case kTraceObject:
+          if (ref.offset >= item.begin && ref.offset < item.end) return true;
+          continue;
+        case kTraceSlice:
+          if (ref.offset < item.end &&
+              item.begin < ref.offset + rec.nums[0]) return true;
+          continue;
+        default:
+          return true;
+      }
+    }
+    return false;
+  }
+
+  const MappedFile &trace;
+  const IndexHeader *header;
+  const uint64_t *defs;
+  const uint64_t *assign_begin;
+  const uint64_t *assigns;
+  const uint64_t *use_begin;
+  const uint64_t *uses;
+  const uint64_t *blocks;
+  const uint64_t *op_name_offsets;
+  std::vector<bool> seen;
+  std::vector<WorkItem> work;
+  std::vector<uint64_t> records;
+  std::vector<std::string> op_names;
+  TraceRecord rec;
+};
+
+static int Query(const std::string &trace_path, bool is_backward,
+                 const char *target_str) {
+  Target target;
+  if (!ParseTarget(target_str, target)) {
+    std::cerr << "Invalid target " << target_str << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  MappedFile trace, index;
+  if (!trace.Open(trace_path)) {
+    std::cerr << "Unable to map " << trace_path << std::endl;
+    return EXIT_FAILURE;
+  }
+  const auto index_path = trace_path + ".idx";
+  if (!index.Open(index_path) || index.size < sizeof(IndexHeader) ||
+      memcmp(index.data, kIndexMagic, kIndexMagicSize)) {
+    std::cerr << "Unable to map " << index_path << "; run `"
+              << "fslice-query index " << trace_path << "` first."
+              << std::endl;
+    return EXIT_FAILURE;
+  }
+  auto header = reinterpret_cast<const IndexHeader *>(index.data);
+  if (header->trace_size != trace.size || !IsIndexSize(*header, index.size)) {
+    std::cerr << index_path << " is out of date." << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  Slicer slicer(trace, index);
+  if (!slicer.Start(target)) {
+    std::cerr << "No such node or block " << target_str << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (is_backward) {
+    slicer.Backward();
+  } else {
+    slicer.Forward();
+  }
+  slicer.Print();
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+  if (3 == argc && !strcmp(argv[1], "index")) {
+    return Index(argv[2]);
+  } else if (4 == argc && !strcmp(argv[1], "backward")) {
+    return Query(argv[2], true, argv[3]);
+  } else if (4 == argc && !strcmp(argv[1], "forward")) {
+    return Query(argv[2], false, argv[3]);
+  }
+  std::cerr << "Usage: " << argv[0] << " index trace" << std::endl
+            << "       " << argv[0] << " (backward|forward) trace target"
+            << std::endl;
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,123 @@
+/* Copyright 2015 Peter Goodman (peter@trailofbits.com), all rights reserved. */
+
+#ifndef FSLICE_TOOLS_TRACEREADER_H_
+#define FSLICE_TOOLS_TRACEREADER_H_
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "runtime/Trace.h"
+
+enum : uint64_t {
+  kTraceReadSize = 1ULL << 20
+};
+
+// Returns true if `[data, data + size)` starts with the magic of a binary
+// trace. Reports an error if it is the magic of another version.
+inline bool IsBinaryTrace(const uint8_t *data, uint64_t size, bool &is_bad) {
+  is_bad = false;
+  if (size < kTraceMagicSize || memcmp(data, kTraceMagic, 6)) return false;
+  if (memcmp(data, kTraceMagic, kTraceMagicSize)) {
+    std::cerr << "Unsupported binary trace version." << std::endl;
+    is_bad = true;
+  }
+  return true;
+}
+
+// Decode the record at `offset` of the trace `[data, data + size)`. Text
+// records are parsed up to the end of their line.
+inline bool ReadRecordAt(const uint8_t *data, uint64_t size, uint64_t offset,
+                         bool is_binary, std::vector<std::string> &op_names,
+                         TraceRecord &rec) {
+  if (offset >= size) return false;
+  const auto end = data + size;
+  auto p = data + offset;
+  if (is_binary) return DecodeRecord(p, end, rec);
+  auto eol = static_cast<const uint8_t *>(memchr(p, '\n', end - p));
+  if (!eol) eol = end;
+  const auto text = reinterpret_cast<const char *>(p);
+  return ParseRecord(text, text + (eol - p), op_names, rec);
+}
+
+// Invoke `cb(rec, offset)` on each record of the text or binary trace read
+// from `in`, where `offset` is the position of the record in the file. Stops
+// early if `cb` returns false. Returns false, after reporting the problem, if
+// the trace is malformed.
+template <typename CB>
+inline bool ReadTrace(FILE *in, bool &is_binary,
+                      std::vector<std::string> &op_names, CB cb) {
+  std::vector<uint8_t> buf;
+  TraceRecord rec;
+  uint64_t base = 0;
+  auto offset = 0UL;
+  auto line = 0UL;
+  auto eof = false;
+  auto is_first = true;
+  is_binary = false;
+
+  while (!eof || offset < buf.size()) {
+    // Refill the buffer, keeping any partially read record at the front.
+    if (!eof) {
+      buf.erase(buf.begin(), buf.begin() + offset);
+      base += offset;
+      offset = 0;
+      const auto old_size = buf.size();
+      buf.resize(old_size + kTraceReadSize);
+      const auto got = fread(&(buf[old_size]), 1, kTraceReadSize, in);
+      buf.resize(old_size + got);
+      eof = !got;
+    }
+
+    const uint8_t *begin = buf.data();
+    const auto end = begin + buf.size();
+    if (is_first) {
+      if (!eof && buf.size() < kTraceMagicSize) continue;
+      is_first = false;
+      auto is_bad = false;
+      is_binary = IsBinaryTrace(begin, buf.size(), is_bad);
+      if (is_bad) return false;
+      if (is_binary) offset = kTraceMagicSize;
+    }
+
+    auto p = begin + offset;
+    if (is_binary) {
+      while (p < end) {
+        auto next = p;
+        if (!DecodeRecord(next, end, rec)) break;
+        if (kTraceOpNames == rec.tag) op_names = rec.names;
+        if (!cb(rec, base + static_cast<uint64_t>(p - begin))) return true;
+        p = next;
+      }
+    } else {
+      while (p < end) {
+        auto eol = static_cast<const uint8_t *>(memchr(p, '\n', end - p));
+        if (!eol) {
+          if (!eof) break;
+          eol = end;
+        }
+        ++line;
+        if (eol != p) {
+          const auto text = reinterpret_cast<const char *>(p);
+          if (!ParseRecord(text, text + (eol - p), op_names, rec)) {
+            std::cerr << "Malformed record on line " << line << std::endl;
+            return false;
+          }
+          if (!cb(rec, base + static_cast<uint64_t>(p - begin))) return true;
+        }
+        p = eol < end ? eol + 1 : end;
+      }
+    }
+    offset = static_cast<uint64_t>(p - begin);
+
+    if (eof && offset < buf.size()) {
+      std::cerr << "Trace is truncated or corrupted." << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+#endif  // FSLICE_TOOLS_TRACEREADER_H_
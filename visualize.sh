@@ -2,6 +2,13 @@
 
 DIR=$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )
 
-cat $DIR/visualize/head.py $1 $DIR/visualize/tail.py > /tmp/visualize.py
-python /tmp/visualize.py > /tmp/visualize.dot
+TRACE=$1
+
+# Reads text and binary (`FSLICE_TRACE_FORMAT=binary`) traces alike. Pass a
+# second argument to also write a summary of each block's dependencies.
+if [ -n "$2" ] ; then
+    $DIR/build/fslice-analyze -s $2 $TRACE > /tmp/visualize.dot
+else
+    $DIR/build/fslice-analyze $TRACE > /tmp/visualize.dot
+fi
 xdot /tmp/visualize.dot
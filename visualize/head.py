@@ -6,11 +6,21 @@ class Base(object):
     self.byte_sources = {}
 
   def __getitem__(self, byte):
+    if isinstance(byte, slice):
+      return [self[i] for i in range(byte.start, byte.stop)]
     self.size = max(self.size, byte + 1)
     return Select(self, byte)
 
   def __setitem__(self, byte, val):
-    self.byte_sources[byte] = val
+    # Range assignments, e.g. `t5[0:4] = t3[8:12]` or `t5[0:4] = t3[8]`.
+    if isinstance(byte, slice):
+      for i in range(byte.start, byte.stop):
+        if isinstance(val, list):
+          self.byte_sources[i] = val[i - byte.start]
+        else:
+          self.byte_sources[i] = val
+    else:
+      self.byte_sources[byte] = val
 
   def Label(self):
     return "n{}".format(id(self))
@@ -79,6 +89,8 @@ class O(Base):
     self.size = len(self.bytes)
 
   def __getitem__(self, byte):
+    if isinstance(byte, slice):
+      return [self[i] for i in range(byte.start, byte.stop)]
     self.size = max(self.size, byte + 1)
     if byte < len(self.bytes):
       return self.bytes[byte]
@@ -92,6 +104,11 @@ class O(Base):
       edges.add("{}:b{} -> {};".format(self.Label(), i, b.Label()))
 
 
+class S(O):
+  def __init__(self, src, offset, size):
+    O.__init__(self, *src[offset:offset + size])
+
+
 class B(Base):
   BLOCKS = []
 